@@ -0,0 +1,65 @@
+/** @file bench.h
+*   @brief Helpers shared by the host benchmarks : test frames, timing, quick mode, checks
+*
+*   `--quick` runs a few iterations only (ctest), the result checks are the same.
+*/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include "esp_timer.h"
+
+/** @brief true if --quick is given */
+static inline bool bench_quick(int argc, char **argv) {
+    int i;
+    for (i = 1; i < argc; i++)
+        if (!strcmp(argv[i], "--quick"))
+            return true;
+    return false;
+}
+
+/** @brief deterministic pseudo random (LCG), the frames are the same on every run */
+static inline uint32_t bench_rand(uint32_t *seed) {
+    *seed = *seed * 1664525u + 1013904223u;
+    return *seed >> 8;
+}
+
+/**
+ * @brief textured frame (sum of waves and some noise) translated by (dx, dy)
+ *
+ *  Frames of a sequence share the seed so the texture moves, only the noise changes.
+ */
+static inline void bench_frame(uint8_t *img, int w, int h, float dx, float dy, uint32_t seed) {
+    int x, y;
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            const float X = x + dx, Y = y + dy;
+            const float v = 110.0f + 50.0f * sinf(X * 0.21f) * cosf(Y * 0.17f)
+                          + 40.0f * sinf((X + Y) * 0.09f) + (bench_rand(&seed) % 7);
+            img[y * w + x] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+}
+
+/** @brief microseconds since t0 */
+static inline double bench_us(int64_t t0) {
+    return (double)(esp_timer_get_time() - t0);
+}
+
+/** @brief count and report a failed check, the benchmark exits with the count */
+#define BENCH_CHECK(errors, cond, ...) do { \
+        if (!(cond)) { \
+            (errors)++; \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__); \
+            fputc('\n', stderr); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,121 @@
+/** @file bench_lk.c
+*   @brief Lucas Kanade : per pixel 25-tap structure tensor against the sliding window one
+*
+*   The old way is kept here as reference : full frame gradients (convH / convV), then for each
+*   pixel the 5x5 window weighted by the squared Gaussian summed tap by tap. The new one is
+*   motion_estimation with LK_OPTICAL_FLOW (products once per pixel, separable running sums).
+*   Both are timed on 320x240 and 640x480, the vectors must match (float rounding may move a
+*   handful of truncated vectors by 1) and, in a full run, the sliding window must be faster.
+*/
+
+#include "bench.h"
+#include "motion.h"
+#include "convolution.h"
+
+#define HALF_WINDOW (WINDOW >> 1)
+
+static const float NoiseThreshold = 0.01f;
+static const float Kernel_isotropic[WINDOW] = {1.0 / 16.0, 4.0 / 16.0, 6.0 / 16.0, 4.0 / 16.0, 1.0 / 16.0};
+
+/** @brief 25-tap LK (before the sliding window), vectors in mv (w * h, zeroed), returns max mag² */
+static int lk_25tap(const uint8_t *ref, const uint8_t *cur, int w, int h, float *buf, MotionVector16_t *mv) {
+    const int N = w * h;
+    float *fx = buf, *fy = fx + N, *ft = fy + N, *tmp = ft + N;
+    int i, j, m, n, max = 0;
+
+    for (i = 0; i < N; i++) {
+        tmp[i] = ref[i];
+        ft[i] = cur[i] - (float)ref[i];
+    }
+    convH(tmp, fx, w, h, Kernel_Dxy, WINDOW);
+    convV(tmp, fy, w, h, Kernel_Dxy, WINDOW);
+    memset(mv, 0, N * sizeof(*mv));
+
+    for (i = HALF_WINDOW; i < h - HALF_WINDOW; i++)
+        for (j = HALF_WINDOW; j < w - HALF_WINDOW; j++) {
+            float a = 0, b = 0, c = 0, Atb0 = 0, Atb1 = 0;
+            for (m = 0; m < WINDOW; m++)
+                for (n = 0; n < WINDOW; n++) {
+                    const float W = Kernel_isotropic[m] * Kernel_isotropic[n];
+                    const int index = (i + m - HALF_WINDOW) * w + j + n - HALF_WINDOW;
+                    const float Ix = fx[index] * W, Iy = fy[index] * W, It = ft[index] * W;
+                    a += Ix * Ix;
+                    c += Iy * Iy;
+                    b += Ix * Iy;
+                    Atb0 += -Ix * It;
+                    Atb1 += -Iy * It;
+                }
+            if (((a + c) - hypotf(2 * b, a - c)) * 0.5f >= NoiseThreshold) {
+                const float det = a * c - b * b;
+                const float vx = (c * Atb0 - b * Atb1) / det;
+                const float vy = (a * Atb1 - b * Atb0) / det;
+                MotionVector16_t *v = &mv[i * w + j];
+                v->vx = (int16_t)vx;
+                v->vy = (int16_t)vy;
+                v->mag2 = (uint16_t)(vx * vx + vy * vy);
+                if (max < v->mag2)
+                    max = v->mag2;
+            }
+        }
+    return max;
+}
+
+int main(int argc, char **argv) {
+    static const int sizes[][2] = {{320, 240}, {640, 480}};
+    const bool quick = bench_quick(argc, argv);
+    const int runs = quick ? 1 : 20;
+    int errors = 0;
+    unsigned s;
+
+    printf("LK_OPTICAL_FLOW, ms per frame (gradients included), best of %d runs\n", runs);
+    printf("   size      25-tap   sliding   speedup   vectors differing\n");
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        const int w = sizes[s][0], h = sizes[s][1], N = w * h;
+        uint8_t *ref = (uint8_t*)malloc(N), *cur = (uint8_t*)malloc(N);
+        float *buf = (float*)malloc(4 * N * sizeof(float));
+        MotionVector16_t *mv = (MotionVector16_t*)malloc(N * sizeof(*mv));
+        MotionEstContext ctx = {.method = LK_OPTICAL_FLOW, .width = w, .height = h};
+        double t_old, t_new;
+        int64_t t0;
+        int r, i, max_old = 0, differ = 0, off = 0;
+
+        bench_frame(ref, w, h, 0, 0, 1);
+        bench_frame(cur, w, h, -0.6f, 0.4f, 1);
+        BENCH_CHECK(errors, init_context(&ctx), "init_context %dx%d", w, h);
+
+        // best of the runs : the least disturbed by the rest of the host
+        t_old = t_new = INFINITY;
+        for (r = 0; r < runs; r++) {
+            t0 = esp_timer_get_time();
+            max_old = lk_25tap(ref, cur, w, h, buf, mv);
+            t_old = fmin(t_old, bench_us(t0) / 1000);
+            t0 = esp_timer_get_time();
+            motion_estimation(&ctx, ref, cur);
+            t_new = fmin(t_new, bench_us(t0) / 1000);
+        }
+
+        for (i = 0; i < N; i++) {
+            const MotionVector16_t *a = &mv[i], *b = &ctx.mv_table[0][i];
+            if (a->vx != b->vx || a->vy != b->vy) {
+                differ++;
+                off += abs(a->vx - b->vx) > 1 || abs(a->vy - b->vy) > 1;
+            }
+        }
+        // truncation to int16 of nearly equal floats : a few vectors by 1 at most
+        BENCH_CHECK(errors, !off && differ <= N / 10000 + 1, "%dx%d : %d vectors differ, %d by more than 1", w, h, differ, off);
+        BENCH_CHECK(errors, abs(max_old - ctx.max) <= 2 * (int)sqrt(ctx.max) + 1, "%dx%d : max %d / %d", w, h, max_old, ctx.max);
+        // the sliding window must stay faster (only timed in a full run)
+        BENCH_CHECK(errors, quick || t_new < t_old, "%dx%d : sliding window slower than 25-tap", w, h);
+        printf("%4dx%-4d  %8.2f  %8.2f   %6.2fx   %d / %d\n", w, h, t_old, t_new, t_old / t_new, differ, N);
+
+        uninit(&ctx);
+        free(ref);
+        free(cur);
+        free(buf);
+        free(mv);
+    }
+
+    if (errors)
+        fprintf(stderr, "%d check(s) failed\n", errors);
+    return errors ? 1 : 0;
+}
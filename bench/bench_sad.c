@@ -0,0 +1,90 @@
+/** @file bench_sad.c
+*   @brief SAD kernels throughput : portable C against the kernel selected by me_sad_select
+*
+*   8x8 and 16x16 blocks read at positions spread over a 640x480 frame, for several alignments
+*   of the current and reference blocks. Every kernel must give the same SAD as me_sad_c.
+*/
+
+#include "bench.h"
+#include "sad.h"
+
+#define W 640
+#define H 480
+
+/** block positions per pass */
+#define POSITIONS 4096
+
+/** @brief offset of the i-th block : 16-aligned then shifted by align */
+static inline int block_offset(int i, int n, int align) {
+    const int x = ((i * 53) % (W - n - 32)) & ~15;
+    const int y = (i * 29) % (H - n);
+    return y * W + x + align;
+}
+
+/** @brief Mpixel/s of sad over the positions, *sum receives the sum of the SAD */
+static double run(me_sad_func sad, const uint8_t *cur, const uint8_t *ref, int n, int ca, int ra,
+                  int passes, uint64_t *sum) {
+    const int64_t t0 = esp_timer_get_time();
+    uint64_t s = 0;
+    int p, i;
+
+    for (p = 0; p < passes; p++)
+        for (i = 0; i < POSITIONS; i++)
+            s += sad(cur + block_offset(i, n, ca), ref + block_offset(i + 7, n, ra), W, n);
+    *sum = s;
+    return (double)passes * POSITIONS * n * n / bench_us(t0);
+}
+
+int main(int argc, char **argv) {
+    static const int align[][2] = {{0, 0}, {0, 1}, {0, 2}, {0, 3}, {0, 4}, {0, 7}, {0, 8}, {0, 15},
+                                   {1, 1}, {3, 8}, {5, 11}};
+    static const int sizes[] = {8, 16};
+    const bool quick = bench_quick(argc, argv);
+    const int passes = quick ? 2 : 200;
+    uint8_t *cur = (uint8_t*)malloc(W * H), *ref = (uint8_t*)malloc(W * H);
+    int errors = 0;
+    unsigned s, a, i;
+
+    bench_frame(cur, W, H, 0, 0, 1);
+    bench_frame(ref, W, H, -2.5f, 1.5f, 2);
+
+    printf("SAD throughput (Mpixel/s), %d blocks x %d passes\n", POSITIONS, passes);
+    printf("size  align(cur,ref)      me_sad_c   me_sad_c_N     selected  speedup\n");
+    for (s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        const int n = sizes[s];
+        const me_sad_func fixed = n == 8 ? me_sad_c_8 : me_sad_c_16;
+        const me_sad_func best = me_sad_select(n);
+        const me_sad_x4_func x4 = me_sad_x4_select(n);
+
+        for (a = 0; a < sizeof(align) / sizeof(*align); a++) {
+            const int ca = align[a][0], ra = align[a][1];
+            uint64_t s_c, s_fixed, s_best;
+            const double c = run(me_sad_c, cur, ref, n, ca, ra, passes, &s_c);
+            const double f = run(fixed, cur, ref, n, ca, ra, passes, &s_fixed);
+            const double b = run(best, cur, ref, n, ca, ra, passes, &s_best);
+
+            BENCH_CHECK(errors, s_fixed == s_c && s_best == s_c, "%dx%d align (%d,%d) : SAD differ", n, n, ca, ra);
+            // x4 and bounded kernels against the scalar one, block by block
+            for (i = 0; i < 256; i++) {
+                const uint8_t *c0 = cur + block_offset(i, n, ca);
+                const uint8_t *r[4] = {ref + block_offset(i, n, ra), ref + block_offset(i + 1, n, ra),
+                                       ref + block_offset(i + 2, n, ra), ref + block_offset(i + 3, n, ra)};
+                uint32_t sad4[4];
+                int k;
+                x4(c0, r, W, n, UINT32_MAX, sad4);
+                for (k = 0; k < 4; k++)
+                    BENCH_CHECK(errors, sad4[k] == me_sad_c(c0, r[k], W, n), "%dx%d x4 differ", n, n);
+                BENCH_CHECK(errors, me_sad_bounded_select(n)(c0, r[0], W, n, UINT32_MAX) == me_sad_c(c0, r[0], W, n),
+                            "%dx%d bounded differ", n, n);
+            }
+            printf("%2dx%-2d    (%2d,%2d)      %10.0f   %10.0f   %10.0f   %5.2fx%s\n", n, n, ca, ra, c, f, b, b / c,
+                   best == fixed ? " (C)" : "");
+        }
+    }
+
+    free(cur);
+    free(ref);
+    if (errors)
+        fprintf(stderr, "%d check(s) failed\n", errors);
+    return errors ? 1 : 0;
+}
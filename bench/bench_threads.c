@@ -0,0 +1,106 @@
+/** @file bench_threads.c
+*   @brief Thread scaling of the band parallel convolutions and of LK, 1 to 8 threads
+*
+*   Convolutions on a 640x480 float frame, with threads started by each call (ConvExec without
+*   pool) and with a persistent pool, then motion_estimation with LK_OPTICAL_FLOW (ctx.threads).
+*   Every threaded output must be the same, bit for bit, as the serial one.
+*/
+
+#include "bench.h"
+#include "motion.h"
+#include "convolution.h"
+#include <unistd.h>
+
+#define W 640
+#define H 480
+#define K 5
+
+static const float Kernel_isotropic[K] = {1.0 / 16.0, 4.0 / 16.0, 6.0 / 16.0, 4.0 / 16.0, 1.0 / 16.0};
+
+static const int thread_counts[] = {1, 2, 4, 8};
+#define COUNTS (int)(sizeof(thread_counts) / sizeof(*thread_counts))
+
+/** @brief the 3 convolutions of the LK gradient stage */
+static bool convolutions(float *in, float *out, const ConvExec *exec) {
+    return convHExec(in, out, W, H, Kernel_Dxy, K, exec)
+        && convVExec(in, out + W * H, W, H, Kernel_Dxy, K, exec)
+        && convolve2DSeparableExec(in, out + 2 * W * H, W, H, Kernel_isotropic, K, Kernel_isotropic, K, exec);
+}
+
+/** @brief best time (ms) of runs calls of the convolutions, out checked against ref */
+static double time_conv(float *in, float *out, const float *ref, const ConvExec *exec, int runs, int *errors) {
+    double best = INFINITY;
+    int r;
+
+    for (r = 0; r < runs; r++) {
+        const int64_t t0 = esp_timer_get_time();
+        memset(out, 0, 3 * W * H * sizeof(float));
+        BENCH_CHECK(*errors, convolutions(in, out, exec), "convolution failed, %d threads", exec->threads);
+        best = fmin(best, bench_us(t0) / 1000);
+    }
+    BENCH_CHECK(*errors, !memcmp(out, ref, 3 * W * H * sizeof(float)),
+                "convolutions with %d threads%s differ from serial", exec->threads, exec->pool ? " (pool)" : "");
+    return best;
+}
+
+int main(int argc, char **argv) {
+    const bool quick = bench_quick(argc, argv);
+    const int runs = quick ? 1 : 20;
+    uint8_t *ref8 = (uint8_t*)malloc(W * H), *cur8 = (uint8_t*)malloc(W * H);
+    float *in = (float*)malloc(W * H * sizeof(float));
+    float *out = (float*)malloc(3 * W * H * sizeof(float)), *ref = (float*)malloc(3 * W * H * sizeof(float));
+    float *work = (float*)malloc(convExecWorkSize(W, K, ME_THREADS_MAX));
+    MotionVector16_t *mv_serial = (MotionVector16_t*)malloc(W * H * sizeof(*mv_serial));
+    double t_spawn[COUNTS], t_pool[COUNTS], t_lk[COUNTS];
+    int errors = 0, i, t;
+
+    bench_frame(ref8, W, H, 0, 0, 1);
+    bench_frame(cur8, W, H, -0.6f, 0.4f, 1);
+    for (i = 0; i < W * H; i++)
+        in[i] = ref8[i];
+    BENCH_CHECK(errors, convolutions(in, ref, NULL), "serial convolutions failed");
+
+    for (t = 0; t < COUNTS; t++) {
+        const int threads = thread_counts[t];
+        MEPool *pool = me_pool_create(threads);
+        const ConvExec spawn = {.threads = threads, .work = work};
+        const ConvExec pooled = {.threads = threads, .work = work, .pool = pool};
+        MotionEstContext ctx = {.method = LK_OPTICAL_FLOW, .width = W, .height = H, .threads = threads};
+        int r;
+
+        t_spawn[t] = time_conv(in, out, ref, &spawn, runs, &errors);
+        t_pool[t] = time_conv(in, out, ref, &pooled, runs, &errors);
+        me_pool_destroy(pool);
+
+        BENCH_CHECK(errors, init_context(&ctx), "init_context, %d threads", threads);
+        t_lk[t] = INFINITY;
+        for (r = 0; r < runs; r++) {
+            const int64_t t0 = esp_timer_get_time();
+            motion_estimation(&ctx, ref8, cur8);
+            t_lk[t] = fmin(t_lk[t], bench_us(t0) / 1000);
+        }
+        if (threads == 1)
+            memcpy(mv_serial, ctx.mv_table[0], W * H * sizeof(*mv_serial));
+        else
+            BENCH_CHECK(errors, !memcmp(mv_serial, ctx.mv_table[0], W * H * sizeof(*mv_serial)),
+                        "LK with %d threads differs from serial", threads);
+        uninit(&ctx);
+    }
+
+    printf("%dx%d, best of %d runs, %ld cpu(s) online\n", W, H, runs, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("threads   conv (ms)  speedup   conv pool (ms)  speedup   LK (ms)  speedup\n");
+    for (t = 0; t < COUNTS; t++)
+        printf("%7d   %9.2f   %5.2fx   %14.2f   %5.2fx   %7.2f   %5.2fx\n", thread_counts[t],
+               t_spawn[t], t_spawn[0] / t_spawn[t], t_pool[t], t_pool[0] / t_pool[t], t_lk[t], t_lk[0] / t_lk[t]);
+
+    free(ref8);
+    free(cur8);
+    free(in);
+    free(out);
+    free(ref);
+    free(work);
+    free(mv_serial);
+    if (errors)
+        fprintf(stderr, "%d check(s) failed\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+/** @file esp_heap_caps.h
+*   @brief Host stub of the ESP-IDF capability allocator (plain heap)
+*/
+#pragma once
+#include <stdlib.h>
+
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+static inline void *heap_caps_malloc(size_t size, int caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+static inline void *heap_caps_calloc(size_t n, size_t size, int caps) {
+    (void)caps;
+    return calloc(n, size);
+}
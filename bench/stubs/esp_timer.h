@@ -0,0 +1,13 @@
+/** @file esp_timer.h
+*   @brief Host stub of esp_timer_get_time (monotonic clock)
+*/
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+/** @return microseconds since an arbitrary origin */
+static inline int64_t esp_timer_get_time(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
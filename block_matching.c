@@ -8,31 +8,31 @@
 #include <math.h>
 #include <string.h>
 #include "esp_timer.h"
-
+#include "esp_heap_caps.h"
+
+/** @brief  allocate DRAM that is byte-addressable */
+static void *_malloc(size_t size) {
+    void *res = malloc(size);
+    if(res)
+        return res;
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
 
 /** @brief Computes the Sum of Absolute Difference (SAD) for the given two blocks \n
  * 
  * \f[ SAD = \sum_{i=0}^{n-1}\sum_{j=0}^{n-1} |Cur_{ij}-Ref_{ij}| \f]
  *
+ * @param c             : context, its kernel c->sad (selected at init_context), block side and width
  * @param currentImg    : img for which we are finding the SAD
  * @param refImg        : img which the SAD is being computed
  * @param offset_curr   : offset applied to img current
  * @param offset_ref    : offset applied to ref img
- * @param mbSize        : the side of the 2 square blcks
- * @param w             : width of images
  * 
  * @return the SAD for the 2 blks * */
 
-int costFuncSAD(const uint8_t *currentImg, const uint8_t *refImg, 
-        int offset_curr, int offset_ref, size_t mbSize, size_t w) {
-    int err = 0, i, j;
-
-    for(i = 0; i < mbSize; i++) {
-        const int iw = i * w ;
-        for(j = 0; j < mbSize; j++) 
-            err += abs(currentImg[iw + j + offset_curr] - refImg[iw + j + offset_ref]);
-    } 
-    return err;
+int costFuncSAD(const MotionEstContext *c, const uint8_t *currentImg, const uint8_t *refImg,
+        int offset_curr, int offset_ref) {
+    return c->sad(currentImg + offset_curr, refImg + offset_ref, c->width, c->mbSize);
 }
 
 /*
@@ -49,39 +49,37 @@ static float imgPSNR(const uint8_t *imgP, const uint8_t *imgComp,\
 }
 */
 
-uint8_t *motionComp(const uint8_t *imgI, const MotionVector16_t *motionVect,\
+bool motionCompBuf(const uint8_t *imgI, const MotionVector16_t *motionVect, uint8_t *imgComp,\
       size_t w, size_t h, size_t mbSize) {
     // we start off from the top left of the image
     // we will walk in steps of mbSize
     // for every marcoblock that we look at we will read the motion vector
     // and put that macroblock from refernce image in the compensated image
-    uint8_t *imgCmp = calloc(w * h, sizeof(uint8_t));
-    uint8_t *imageComp = imgCmp;
+    if(!imgI || !motionVect || !imgComp || !mbSize)
+        return false;
+    memset(imgComp, 0, w * h);
+
+    for(size_t i = 0; i + mbSize <= h; i += mbSize) {
+        for(size_t j = 0; j + mbSize <= w; j += mbSize, motionVect++) {
+            // reference block, kept inside the frame
+            const int x = mmax(0, mmin((int)j + motionVect->vx, (int)(w - mbSize)));
+            const int y = mmax(0, mmin((int)i + motionVect->vy, (int)(h - mbSize)));
+            for(size_t k = 0; k < mbSize; k++)
+                memcpy(imgComp + (i + k) * w + j, imgI + (y + k) * w + x, mbSize);
+        }
+    }
+    return true;
+}
 
-    if(!imageComp) 
-        return NULL;
+uint8_t *motionComp(const uint8_t *imgI, const MotionVector16_t *motionVect,\
+      size_t w, size_t h, size_t mbSize) {
+    uint8_t *imgComp = (uint8_t*)_malloc(w * h);
 
-    for( int i = 0; i < h - mbSize + 1; i+=mbSize) {
-        for( int j = 0; j < w - mbSize + 1; i+=mbSize) {
-            const int dx = motionVect->vx;
-            const int dy = motionVect->vy;
-            const int wdy = dy * w;
-            //const refBlkV = i + dy;
-            //const refBlkH = j + dx;
-            for( int k = mbSize; k--; ) {
-                for( int m = 0; m < mbSize; m++) {
-                    //imageComp[(k + i) * w + (m + j)] = imgI[(k + refBlkV) * w + (refBlkH + m)];
-                    imageComp[m + j] = imgI[wdy + (j + dx + m)]; // faster computation than commented version
-                }
-                imageComp += w;
-                imgI += w;
-            }        
-            motionVect++;
-        }
-        imageComp += w;
-        imgI += w;
+    if (imgComp && !motionCompBuf(imgI, motionVect, imgComp, w, h, mbSize)) {
+        free(imgComp);
+        return NULL;
     }
-    return imgCmp;
+    return imgComp;
 }
 
 // The index points for Small Diamond Search pattern
@@ -92,15 +90,25 @@ uint8_t *motionComp(const uint8_t *imgI, const MotionVector16_t *motionVect,\
                         {0, 1},
                         {1, 1}};
 
-bool motionEstARPS(MotionEstContext *c) {
+size_t me_arps_memory(int search_param, int threads) {
+    // one check array per worker, in the workspace : (2p+1)² bytes would overflow a worker stack for large p
+    return (size_t)me_threads(threads) * (2 * search_param + 1) * (2 * search_param + 1);
+}
+
+/**
+ * @brief ARPS of the block row mb_y
+ *
+ *  Rows are independent : the first block of a row has no left neighbour to predict the
+ *  step size from. All the search state is local, a thread per row can run it.
+ * @param check  (2p+1)² bytes of the worker, the points already checked
+ */
+static void arps_row(MotionEstContext *c, int mb_y, uint8_t *check) {
     // Loading all param
-    const uint8_t *imgP = c->data_cur;
-    const uint8_t *imgI = c->data_ref;
     const size_t w = (size_t)c->b_width<<c->log2_mbSize;    
     const size_t h = (size_t)c->b_height<<c->log2_mbSize;
     const size_t mbSize = (size_t)c->mbSize;
     const int p = c->search_param;
-    MotionVector16_t *vectors = c->mv_table[0];
+    MotionVector16_t *vectors = c->mv_table[0] + mb_y * c->b_width;
 
     // Zero-Motion Prejudgement threshold
     int zmp_T = c->mbSize << (c->log2_mbSize + 1);
@@ -113,13 +121,17 @@ bool motionEstARPS(MotionEstContext *c) {
     // The index points for Large Diamond Search pattern
     int LDSP[6][2];
 
+    // Candidates of the current pattern scored at once by get_cost_multi
+    int cand[6][2], cand_k[6], n;
+    uint64_t cand_costs[6];
+
     // We will be storing the positions of points where the checking has been already done in an array
     // that is initialised to zero. As one point is checked, we set the corresponding element in the array to one.
-    int checkArray[2 * p + 1][2 * p + 1];
-    memset(checkArray, 0, sizeof(checkArray[0][0]) * pow(2 * p + 1, 2));
+    uint8_t (*checkArray)[2 * p + 1] = (uint8_t (*)[2 * p + 1])check;
+    const size_t check_size = (size_t)(2 * p + 1) * (2 * p + 1);
+    memset(check, 0, check_size);
 
     //int computations = 0;
-    c->max = 0;
     //mbCount will keep track of how many blocks we have evaluated
     //int mbCount = 0;
 
@@ -127,152 +139,202 @@ bool motionEstARPS(MotionEstContext *c) {
     //uint8_t *currentBlk = malloc(mbSize * mbSize);
     //uint8_t *refBlk = malloc(mbSize * mbSize);
 
-    int i, j, k, point;
-    // we start  off from the top left of image
+    const int i = mb_y << c->log2_mbSize;
+    int j, k, point;
+    // we start  off from the left of the row
     // we will walk in step of mbSize
-    for(i = 0; i < h - mbSize + 1; i+=mbSize) {
-        const int iw = i * w;
-        for(j = 0; j < w - mbSize + 1; j+=mbSize) {
-            // the ARPS starts : we are scanning in raster order
-            int x = j,
-                y = i;
-
-            //                           ##  STEP1:  ##
-            //Compute the matching error (SAD) between the current block and the block at the same 
-            //location in the ref-erence frame (i.e., the center of the current search window
-
-            // initialise macroblock  matlab : MB = img(i:i+mbSize-1, j:j+mbSize-1)
-            costs[2] = costFuncSAD(imgP, imgI, iw + j, iw + j, mbSize, w);
-
-            if(costs[2] < zmp_T) {
-                vectors->vx = 0;  vectors->vy = 0; vectors->mag2 = 0;
-                vectors++;
-                continue;
-            }
+    for(j = 0; j < w - mbSize + 1; j+=mbSize) {
+        // the ARPS starts : we are scanning in raster order
+        int x = j,
+            y = i;
 
-            checkArray[p + 1][p + 1] = 1;
-
-            // if we are in the left most column then we have to make sure that
-            // we just do the LDSP with stepSize = 2
-            if (!j) {
-                stepSize = 2;
-                maxIndex = 4;
-            } else {
-                vectors--;
-                stepSize = mmax(abs(vectors->vx),  abs(vectors->vy));
-                // We check if prediction overlap LDSP in that case we dont recompute
-                if( (abs(vectors->vx) == stepSize && vectors->vy == 0)
-                    || (abs(vectors->vy) == stepSize && vectors->vx == 0))
-                    maxIndex = 4; //we just have to check at the rood pattern 5 points
-                else {
-                    maxIndex = 5; //we have to check 6pts
-                    LDSP[5][0] = vectors->vy;
-                    LDSP[5][1] = vectors->vx;
-                }
-                vectors++;
+        //                           ##  STEP1:  ##
+        //Compute the matching error (SAD) between the current block and the block at the same 
+        //location in the ref-erence frame (i.e., the center of the current search window
+
+        // initialise macroblock  matlab : MB = img(i:i+mbSize-1, j:j+mbSize-1)
+        costs[2] = c->get_cost(c, j, i, j, i);
+
+        if(costs[2] < zmp_T) {
+            vectors->vx = 0;  vectors->vy = 0; vectors->mag2 = 0;
+            vectors++;
+            continue;
+        }
+
+        checkArray[p][p] = 1;
+
+        // if we are in the left most column then we have to make sure that
+        // we just do the LDSP with stepSize = 2
+        if (!j) {
+            stepSize = 2;
+            maxIndex = 4;
+        } else {
+            vectors--;
+            stepSize = mmax(abs(vectors->vx),  abs(vectors->vy));
+            // We check if prediction overlap LDSP in that case we dont recompute
+            if( (abs(vectors->vx) == stepSize && vectors->vy == 0)
+                || (abs(vectors->vy) == stepSize && vectors->vx == 0))
+                maxIndex = 4; //we just have to check at the rood pattern 5 points
+            else {
+                maxIndex = 5; //we have to check 6pts
+                LDSP[5][0] = vectors->vx;
+                LDSP[5][1] = vectors->vy;
             }
+            vectors++;
+        }
 
-            // The index points for first and only LDSP
-            LDSP[0][0] = 0          ; LDSP[0][1] = -stepSize;
-            LDSP[1][0] = -stepSize  ; LDSP[1][1] = 0;
-            LDSP[2][0] = 0          ; LDSP[2][1] = 0;
-            LDSP[3][0] =  stepSize  ; LDSP[3][1] = 0;
-            LDSP[4][0] = 0          ; LDSP[4][1] = stepSize;
-            
-            // do the LDSP
-            //                          ##  STEP 2: ##
-            //Align the center of ARP with the center point of the search window and 
-            //check its 4 search points (plus the position of the predicted MV if no overlap)
-            //to find out the current MME point
-            cost = costs[2], point = 2;
-            for (k = 0; k < maxIndex; k++) {
+        // The index points for first and only LDSP
+        LDSP[0][0] = 0          ; LDSP[0][1] = -stepSize;
+        LDSP[1][0] = -stepSize  ; LDSP[1][1] = 0;
+        LDSP[2][0] = 0          ; LDSP[2][1] = 0;
+        LDSP[3][0] =  stepSize  ; LDSP[3][1] = 0;
+        LDSP[4][0] = 0          ; LDSP[4][1] = stepSize;
+        
+        // do the LDSP
+        //                          ##  STEP 2: ##
+        //Align the center of ARP with the center point of the search window and 
+        //check its 4 search points (plus the position of the predicted MV if no overlap)
+        //to find out the current MME point
+        cost = costs[2], point = 2;
+        if (stepSize) {
+            for (k = 0, n = 0; k <= maxIndex; k++) {
                 const int refBlkVer = y + LDSP[k][1];
                 const int refBlkHor = x + LDSP[k][0];
                 if( refBlkVer < 0 || refBlkVer + mbSize - 1 > h - 1 || 
                         refBlkHor < 0 || refBlkHor + mbSize - 1 > w - 1)
                     continue; //outside image boundary
-                if (k == 2 || stepSize == 0)
+                if (k == 2)
                     continue; //center point already calculated
 
-                costs[k] = costFuncSAD(imgP, imgI, iw + j, refBlkVer * w + refBlkHor, mbSize, w);
-                //computations++;
-                checkArray[LDSP[k][1] + p + 1][LDSP[k][0] + p + 1] = 1;                
+                cand[n][0] = refBlkHor;
+                cand[n][1] = refBlkVer;
+                cand_k[n++] = k;
+                checkArray[LDSP[k][1] + p][LDSP[k][0] + p] = 1;                
+            }
+            // score the whole pattern in one pass over the current block
+            c->get_cost_multi(c, j, i, cand, n, cost, cand_costs);
+            for (k = 0; k < n; k++) {
+                costs[cand_k[k]] = cand_costs[k];
+                if (cand_costs[k] < cost) {
+                    cost = cand_costs[k];
+                    point = cand_k[k];
+                }
+            }
+        }
 
+        //                         ## STEP 3 ##: 
+        //Set  the  center  point  of  the  unit-size  rood  pattern
+        //(URP) at the MME point found in the previous step and check its points.
+
+        x += LDSP[point][0];
+        y += LDSP[point][1];
+        memset(costs, UINT32_MAX, 6 * sizeof(int));
+        costs[2] = cost;
+
+        //If the new MME point is not incurred at the center of the current URP,
+        // repeat this step (step1); otherwise, the MV is found,corresponding to the MME 
+        //point identified in this step.Note that in our implementation, a checking 
+        //bit-map (one bitfor denoting the status of each macroblock) has been employed
+        //to  record  whether  a  search  point  under  checking  has already been 
+        //examined before, so that duplicated checking computation can be avoided
+
+        // The doneFlag is set to 1 when the minimum is at the center of the diamond
+        // do the SDSP
+        int doneFlag = 0;
+        while(!doneFlag) {
+            cost = costs[2]; point = 2;
+            for(k = 0, n = 0; k < 5; k++) {
+                const int refBlkVer = y + SDSP[k][1];
+                const int refBlkHor = x + SDSP[k][0];
+                if( refBlkVer < 0 || refBlkVer + mbSize > h 
+                        || refBlkHor < 0 || refBlkHor + mbSize > w)
+                        continue;
+                if(k == 2)
+                    continue;
+                if(refBlkHor < j-p || refBlkHor > j+p || refBlkVer < i-p || refBlkVer > i+p)
+                    continue;
+                if(checkArray[y - i + SDSP[k][1] + p][x - j + SDSP[k][0] + p] == 1)
+                    continue;
+
+                cand[n][0] = refBlkHor;
+                cand[n][1] = refBlkVer;
+                cand_k[n++] = k;
+                checkArray[y - i + SDSP[k][1] + p][x - j + SDSP[k][0] + p] = 1;
+            }
+            c->get_cost_multi(c, j, i, cand, n, cost, cand_costs);
+            for (k = 0; k < n; k++)
+                costs[cand_k[k]] = cand_costs[k];
+
+            //Find min of costs and index (already checked points keep their cost)
+            for (k = 0; k < 5; k++) {
                 if (costs[k] < cost) {
                     cost = costs[k];
                     point = k;
                 }
-            }            
-
-            //                         ## STEP 3 ##: 
-            //Set  the  center  point  of  the  unit-size  rood  pattern
-            //(URP) at the MME point found in the previous step and check its points.
-
-            x += LDSP[point][0];
-            y += LDSP[point][1];
-            memset(costs, UINT32_MAX, 6 * sizeof(int));
-            costs[2] = cost;
-
-            //If the new MME point is not incurred at the center of the current URP,
-            // repeat this step (step1); otherwise, the MV is found,corresponding to the MME 
-            //point identified in this step.Note that in our implementation, a checking 
-            //bit-map (one bitfor denoting the status of each macroblock) has been employed
-            //to  record  whether  a  search  point  under  checking  has already been 
-            //examined before, so that duplicated checking computation can be avoided
-
-            // The doneFlag is set to 1 when the minimum is at the center of the diamond
-            // do the SDSP
-            int doneFlag = 0;
-            while(!doneFlag) {
-                cost = costs[2]; point = 2;
-                for(k = 0; k < 5; k++) {
-                    const int refBlkVer = y + SDSP[k][1];
-                    const int refBlkHor = x + SDSP[k][0];
-                    if( refBlkVer < 0 || refBlkVer + mbSize > h 
-                            || refBlkVer < 0 || refBlkHor + mbSize > w)
-                            continue;
-                    if(k == 2)
-                        continue;
-                    if(refBlkHor < j-p || refBlkHor > j+p || refBlkVer < i-p || refBlkVer > i+p)
-                        continue;
-                    if(checkArray[y - i + SDSP[k][1] + p + 1][x - j + SDSP[k][0] + p + 1] == 1) {
-                        //Find min of costs and index
-                        if (costs[k] < cost) {
-                            cost = costs[k];
-                            point = k;
-                        }
-                        continue;
-                    }
+            }
 
-                    costs[k] = costFuncSAD(imgP, imgI, iw + j, refBlkVer * w + refBlkHor, mbSize, w);
-                    checkArray[y - i + SDSP[k][1] + p + 1][x - j + SDSP[k][0] + p + 1] = 1;
+            if(point == 2) 
+                doneFlag = 1; // Point incurred at the current URP
+            else {
+                x += SDSP[point][0]; // else align center with SDSP
+                y += SDSP[point][1];
+                memset(costs, UINT32_MAX, 6 * sizeof(int));
+                costs[2] = cost;
+            }
+        }
+        //End of step3
+        vectors->vx = x - j;
+        vectors->vy = y - i;
+        vectors->mag2 = powf(vectors->vx, 2) + powf(vectors->vy, 2);
+        c->max = mmax(c->max, vectors->mag2);
+        vectors++;
+        memset(costs, UINT32_MAX, 6 * sizeof(int));
+        memset(check, 0, check_size);
+    }
+}
 
-                    //Find min of costs and index
-                    if (costs[k] < cost) {
-                        cost = costs[k];
-                        point = k;
-                    }
-                }
+/** @brief tiles of block rows of motionEstARPS, results per worker */
+typedef struct {
+    MotionEstContext *ctx;
+    int max[ME_THREADS_MAX];
+    uint32_t cost_count[ME_THREADS_MAX], cost_aborted[ME_THREADS_MAX], sea_rejected[ME_THREADS_MAX];
+} ARPSRows;
+
+static void arps_rows(void *arg, int t, int begin, int end) {
+    ARPSRows *rows = (ARPSRows*)arg;
+    // private copy : the cost statistics and max of the worker
+    MotionEstContext c = *rows->ctx;
+    uint8_t *check = (uint8_t*)c.workspace + (size_t)t * me_arps_memory(c.search_param, 1);
+    int mb_y;
+
+    c.max = 0;
+    c.cost_count = c.cost_aborted = c.sea_rejected = 0;
+    for (mb_y = begin; mb_y < end; mb_y++)
+        arps_row(&c, mb_y, check);
+    rows->max[t] = mmax(rows->max[t], c.max);
+    rows->cost_count[t] += c.cost_count;
+    rows->cost_aborted[t] += c.cost_aborted;
+    rows->sea_rejected[t] += c.sea_rejected;
+}
 
-                if(point == 2) 
-                    doneFlag = 1; // Point incurred at the current URP
-                else {
-                    x += SDSP[point][0]; // else align center with SDSP
-                    y += SDSP[point][1];
-                    memset(costs, UINT32_MAX, 6 * sizeof(int));
-                    costs[2] = cost;
-                }
-            }
-            //End of step3
-            vectors->vx = y - i;
-            vectors->vy = x - j;
-            vectors->mag2 = powf(vectors->vx, 2) + powf(vectors->vx, 2);
-            c->max = mmax(c->max, vectors->mag2);
-            vectors++;
-            memset(costs, UINT32_MAX, 6 * sizeof(int));
-            memset(checkArray, 0, sizeof(checkArray[0][0]) * pow(2 * p + 1, 2));
+bool motionEstARPS(MotionEstContext *c) {
+    int mb_y, t, workers;
+
+    c->max = 0;
+    if (c->pool) {
+        // zero motion prejudgement makes some rows much cheaper : small tiles, stolen by idle workers
+        ARPSRows rows = {.ctx = c};
+        workers = me_parallel_tiles(c->pool, c->b_height, c->tile_size > 0 ? c->tile_size : 1, &arps_rows, &rows);
+        for (t = 0; t < workers; t++) {
+            c->max = mmax(c->max, rows.max[t]);
+            c->cost_count += rows.cost_count[t];
+            c->cost_aborted += rows.cost_aborted[t];
+            c->sea_rejected += rows.sea_rejected[t];
         }
+        return 1;
     }
 
+    for (mb_y = 0; mb_y < c->b_height; mb_y++)
+        arps_row(c, mb_y, (uint8_t*)c->workspace);
     return 1;
 }
@@ -10,489 +10,460 @@
 #include <stdint.h>
 #include <math.h>
 #include <stdlib.h> 
+#include <stddef.h>
+#include <string.h>
 
+const float Kernel_Dxy[KERNEL_DXY_SIZE] = {-1.0 / 12.0, 8.0 / 12, 0, -8.0 / 12.0, 1.0 / 12.0};
 
 ///////////////////////////////////////////////////////////////////////////////
-// unsigned char (8-bit) version
+// 5-tap symmetric / antisymmetric kernels
+// The mirrored taps are folded (3 multiplies instead of 5, 2 for antisymmetric)
+// and each pass is a loop over the columns of whole rows the compiler can vectorize.
+// Out of frame samples are 0 like the partial kernels of the generic code.
 ///////////////////////////////////////////////////////////////////////////////
-bool convolve2DSeparable8(unsigned char* in, unsigned char* out, int dataSizeX, int dataSizeY, 
-                         float* kernelX, int kSizeX, float* kernelY, int kSizeY)
-{
-    int i, j, k, m, n;
-    float *tmp, *sum;                               // intermediate data buffer
-    unsigned char *inPtr, *outPtr;                  // working pointers
-    float *tmpPtr, *tmpPtr2;                        // working pointers
-    int kCenter, kOffset, endIndex;                 // kernel indice
-
-    // check validity of params
-    if(!in || !out || !kernelX || !kernelY) return false;
-    if(dataSizeX <= 0 || kSizeX <= 0) return false;
-
-    // allocate temp storage to keep intermediate result
-    tmp = (float*)malloc(dataSizeX * dataSizeY * sizeof(float));
-    if (!tmp) return false;  // memory allocation error
-
-    // store accumulated sum
-    sum = (float*)malloc(dataSizeX * sizeof(float));
-    if (!sum)  return false;  // memory allocation error
-
-    // covolve horizontal direction ///////////////////////
+#define KERNEL_GENERIC          0
+#define KERNEL_SYMMETRIC        1   // k[0] == k[4], k[1] == k[3]
+#define KERNEL_ANTISYMMETRIC    2   // k[0] == -k[4], k[1] == -k[3], k[2] == 0
 
-    // find center position of kernel (half of kernel size)
-    kCenter = kSizeX >> 1;                          // center index of kernel array
-    endIndex = dataSizeX - kCenter;                 // index for full kernel convolution
+static int kernel5_type(const float* k, int kSize)
+{
+    if (kSize != 5)
+        return KERNEL_GENERIC;
+    if (k[0] == k[4] && k[1] == k[3])
+        return KERNEL_SYMMETRIC;
+    if (k[0] == -k[4] && k[1] == -k[3] && k[2] == 0)
+        return KERNEL_ANTISYMMETRIC;
+    return KERNEL_GENERIC;
+}
 
-    // init working pointers
-    inPtr = in;
-    tmpPtr = tmp;                                   // store intermediate results from 1D horizontal convolution
+/** out[j] = sum in[j + 2 - m] * k[m] over the row, zero padded */
+static void conv5H(const float* restrict in, float* restrict out, int n, const float* k, int type)
+{
+    const float k0 = k[0], k1 = k[1], k2 = k[2];
+    int j;
 
-    // start horizontal convolution (x-direction)
-    for(i=0; i < dataSizeY; ++i)                    // number of rows
+    // the 2 first and last columns (and tiny rows) with the generic zero padded sum
+    for (j = 0; j < n; j++)
     {
-
-        kOffset = 0;                                // starting index of partial kernel varies for each sample
-
-        // COLUMN FROM index=0 TO index=kCenter-1
-        for(j=0; j < kCenter; ++j)
-        {
-            *tmpPtr = 0;                            // init to 0 before accumulation
-
-            for(k = kCenter + kOffset, m = 0; k >= 0; --k, ++m) // convolve with partial of kernel
-            {
-                *tmpPtr += *(inPtr + m) * kernelX[k];
-            }
-            ++tmpPtr;                               // next output
-            ++kOffset;                              // increase starting index of kernel
-        }
-
-        // COLUMN FROM index=kCenter TO index=(dataSizeX-kCenter-1)
-        for(j = kCenter; j < endIndex; ++j)
-        {
-            *tmpPtr = 0;                            // init to 0 before accumulate
-
-            for(k = kSizeX-1, m = 0; k >= 0; --k, ++m)  // full kernel
-            {
-                *tmpPtr += *(inPtr + m) * kernelX[k];
-            }
-            ++inPtr;                                // next input
-            ++tmpPtr;                               // next output
-        }
-
-        kOffset = 1;                                // ending index of partial kernel varies for each sample
-
-        // COLUMN FROM index=(dataSizeX-kCenter) TO index=(dataSizeX-1)
-        for(j = endIndex; j < dataSizeX; ++j)
-        {
-            *tmpPtr = 0;                            // init to 0 before accumulation
-
-            for(k = kSizeX-1, m=0; k >= kOffset; --k, ++m)   // convolve with partial of kernel
-            {
-                *tmpPtr += *(inPtr + m) * kernelX[k];
-            }
-            ++inPtr;                                // next input
-            ++tmpPtr;                               // next output
-            ++kOffset;                              // increase ending index of partial kernel
-        }
-
-        inPtr += kCenter;                           // next row
+        float s = 0;
+        int m;
+        if (j == 2 && n > 4)
+            j = n - 2;
+        for (m = 0; m < 5; m++)
+            if (j + 2 - m >= 0 && j + 2 - m < n)
+                s += in[j + 2 - m] * k[m];
+        out[j] = s;
     }
-    // END OF HORIZONTAL CONVOLUTION //////////////////////
-
-    // start vertical direction ///////////////////////////
+    if (n <= 4)
+        return;
+    if (type == KERNEL_SYMMETRIC)
+        for (j = 2; j < n - 2; j++)
+            out[j] = k2 * in[j] + k1 * (in[j - 1] + in[j + 1]) + k0 * (in[j - 2] + in[j + 2]);
+    else
+        for (j = 2; j < n - 2; j++)
+            out[j] = k1 * (in[j + 1] - in[j - 1]) + k0 * (in[j + 2] - in[j - 2]);
+}
 
-    // find center position of kernel (half of kernel size)
-    kCenter = kSizeY >> 1;                          // center index of vertical kernel
-    endIndex = dataSizeY - kCenter;                 // index where full kernel convolution should stop
+/** out = sum r[m] * k[4 - m] for the 5 rows r[0..4] (r[m] pointing to zeros out of the frame) */
+static void conv5V(const float* const r[5], float* restrict out, int n, const float* k, int type)
+{
+    const float k0 = k[0], k1 = k[1], k2 = k[2];
+    const float* restrict a = r[0];
+    const float* restrict b = r[1];
+    const float* restrict c = r[2];
+    const float* restrict d = r[3];
+    const float* restrict e = r[4];
+    int i;
+
+    if (type == KERNEL_SYMMETRIC)
+        for (i = 0; i < n; i++)
+            out[i] = k2 * c[i] + k1 * (b[i] + d[i]) + k0 * (a[i] + e[i]);
+    else
+        for (i = 0; i < n; i++)
+            out[i] = k1 * (d[i] - b[i]) + k0 * (e[i] - a[i]);
+}
 
-    // set working pointers
-    tmpPtr = tmpPtr2 = tmp;
-    outPtr = out;
 
-    // clear out array before accumulation
-    for(i = 0; i < dataSizeX; ++i)
-        sum[i] = 0;
+///////////////////////////////////////////////////////////////////////////////
+// Fused separable convolution
+// The horizontal pass fills a ring of kSizeY rows which the vertical pass reads
+// as soon as the rows of its kernel are there : the intermediate stays a strip of
+// a few rows (internal SRAM / L1 sized for usual widths) instead of a whole frame.
+///////////////////////////////////////////////////////////////////////////////
 
-    // start to convolve vertical direction (y-direction)
+/** out[j] = sum in[j - kCenter + m] * k[kSize - 1 - m] over the row, zero padded (any kernel) */
+static void convRowH(const float* restrict in, float* restrict out, int n, const float* k, int kSize)
+{
+    const int kCenter = kSize >> 1;
+    int j, m;
 
-    // ROW FROM index=0 TO index=(kCenter-1)
-    kOffset = 0;                                    // starting index of partial kernel varies for each sample
-    for(i=0; i < kCenter; ++i)
+    for (j = 0; j < n; j++)
     {
-        for(k = kCenter + kOffset; k >= 0; --k)     // convolve with partial kernel
-        {
-            for(j=0; j < dataSizeX; ++j)
-            {
-                sum[j] += *tmpPtr * kernelY[k];
-                ++tmpPtr;
-            }
-        }
+        const int m0 = j < kCenter ? kCenter - j : 0;
+        const int m1 = j + kSize - kCenter > n ? n - j + kCenter : kSize;
+        float s = 0;
+        for (m = m0; m < m1; m++)
+            s += in[j - kCenter + m] * k[kSize - 1 - m];
+        out[j] = s;
+    }
+}
 
-        for(n = 0; n < dataSizeX; ++n)              // convert and copy from sum to out
-        {
-            // covert negative to positive
-            *outPtr = (unsigned char)((float)fabs(sum[n]) + 0.5f);
-            sum[n] = 0;                             // reset to zero for next summing
-            ++outPtr;                               // next element of output
-        }
+/** out = sum r[m] * k[kSize - 1 - m] for the kSize rows r (any kernel) */
+static void convRowV(const float* const* r, float* restrict out, int n, const float* k, int kSize)
+{
+    int i, m;
 
-        tmpPtr = tmpPtr2;                           // reset input pointer
-        ++kOffset;                                  // increase starting index of kernel
+    for (i = 0; i < n; i++)
+        out[i] = 0;
+    for (m = 0; m < kSize; m++)
+    {
+        const float* restrict row = r[m];
+        const float km = k[kSize - 1 - m];
+        for (i = 0; i < n; i++)
+            out[i] += row[i] * km;
     }
+}
 
-    // ROW FROM index=kCenter TO index=(dataSizeY-kCenter-1)
-    for(i = kCenter; i < endIndex; ++i)
-    {
-        for(k = kSizeY -1; k >= 0; --k)             // convolve with full kernel
-        {
-            for(j = 0; j < dataSizeX; ++j)
-            {
-                sum[j] += *tmpPtr * kernelY[k];
-                ++tmpPtr;
-            }
-        }
+/** vertical pass of in (dataSizeY rows) into the rows [y0, y1) of out, zero is a row of dataSizeX zeros */
+static void convVRows(const float* in, float* out, int dataSizeX, int dataSizeY, const float* k, int kSize,
+                      int y0, int y1, const float* zero)
+{
+    const int type = kernel5_type(k, kSize);
+    const int kCenter = kSize >> 1;
+    const float* r[kSize];
+    int i, m;
 
-        for(n = 0; n < dataSizeX; ++n)              // convert and copy from sum to out
+    for (i = y0; i < y1; i++)
+    {
+        for (m = 0; m < kSize; m++)
         {
-            // covert negative to positive
-            *outPtr = (unsigned char)((float)fabs(sum[n]) + 0.5f);
-            sum[n] = 0;                             // reset for next summing
-            ++outPtr;                               // next output
+            const int row = i - kCenter + m;
+            r[m] = row >= 0 && row < dataSizeY ? in + row * dataSizeX : zero;
         }
-
-        // move to next row
-        tmpPtr2 += dataSizeX;
-        tmpPtr = tmpPtr2;
+        if (type != KERNEL_GENERIC)
+            conv5V(r, out + i * dataSizeX, dataSizeX, k, type);
+        else
+            convRowV(r, out + i * dataSizeX, dataSizeX, k, kSize);
     }
+}
 
-    // ROW FROM index=(dataSizeY-kCenter) TO index=(dataSizeY-1)
-    kOffset = 1;                                    // ending index of partial kernel varies for each sample
-    for(i=endIndex; i < dataSizeY; ++i)
+/**
+ * horizontal then vertical pass of inF (float) or in8 (8-bit) into the rows [y0, y1) of outF or out8,
+ * work as convolve2DSeparableWorkSize. A band starting below the top first fills the ring with its kCenter halo rows.
+ */
+static void convSeparableRing(const float* inF, const unsigned char* in8, float* outF, unsigned char* out8,
+    int dataSizeX, int dataSizeY, const float* kernelX, int kSizeX, const float* kernelY, int kSizeY,
+    int y0, int y1, float* work)
+{
+    const int typeX = kernel5_type(kernelX, kSizeX), typeY = kernel5_type(kernelY, kSizeY);
+    const int kCenter = kSizeY >> 1;
+    float* zero = work + kSizeY * dataSizeX;     // out of frame rows
+    float* sum = zero + dataSizeX;               // vertical result of the 8-bit version
+    float* line = sum + dataSizeX;               // 8-bit input row as float
+    const float* r[kSizeY];
+    int i, j, m, next = y0 > kCenter ? y0 - kCenter : 0;   // next row of the horizontal pass
+
+    for (j = 0; j < dataSizeX; ++j)
+        zero[j] = 0;
+
+    for (i = y0; i < y1; ++i)
     {
-        for(k = kSizeY-1; k >= kOffset; --k)        // convolve with partial kernel
+        // horizontal pass up to the last row of the kernel, into the slot of a row no longer needed
+        for (; next < dataSizeY && next <= i - kCenter + kSizeY - 1; ++next)
         {
-            for(j=0; j < dataSizeX; ++j)
+            const float* src = inF + next * dataSizeX;
+            float* dst = work + (next % kSizeY) * dataSizeX;
+            if (in8)
             {
-                sum[j] += *tmpPtr * kernelY[k];
-                ++tmpPtr;
+                for (j = 0; j < dataSizeX; ++j)
+                    line[j] = in8[next * dataSizeX + j];
+                src = line;
             }
+            if (typeX != KERNEL_GENERIC)
+                conv5H(src, dst, dataSizeX, kernelX, typeX);
+            else
+                convRowH(src, dst, dataSizeX, kernelX, kSizeX);
         }
 
-        for(n = 0; n < dataSizeX; ++n)              // convert and copy from sum to out
+        for (m = 0; m < kSizeY; ++m)
         {
-            // covert negative to positive
-            *outPtr = (unsigned char)((float)fabs(sum[n]) + 0.5f);
-            sum[n] = 0;                             // reset for next summing
-            ++outPtr;                               // next output
+            const int row = i - kCenter + m;
+            r[m] = row >= 0 && row < dataSizeY ? work + (row % kSizeY) * dataSizeX : zero;
         }
-
-        // move to next row
-        tmpPtr2 += dataSizeX;
-        tmpPtr = tmpPtr2;                           // next input
-        ++kOffset;                                  // increase ending index of kernel
+        float* dst = outF ? outF + i * dataSizeX : sum;
+        if (typeY != KERNEL_GENERIC)
+            conv5V(r, dst, dataSizeX, kernelY, typeY);
+        else
+            convRowV(r, dst, dataSizeX, kernelY, kSizeY);
+
+        // covert negative to positive
+        if (outF)
+            for (j = 0; j < dataSizeX; ++j)
+                dst[j] = (float)((float)fabs(dst[j]) + 0.5f);
+        else
+            for (j = 0; j < dataSizeX; ++j)
+                out8[i * dataSizeX + j] = (unsigned char)((float)fabs(sum[j]) + 0.5f);
     }
-    // END OF VERTICAL CONVOLUTION ////////////////////////
-
-    // deallocate temp buffers
-    free(tmp);
-    free(sum);
-    return true;
 }
 
+
 ///////////////////////////////////////////////////////////////////////////////
-// float version
+// Integer binomial kernels (8-bit version)
+// A kernel of non-negative taps k[m] = ki[m] / 2^s summing to 1, like [1 4 6 4 1] / 16,
+// is applied with integer taps : both passes in uint16, a single rounding shift at the end.
+// Every product is exact in float too, so the result is the same bytes as the float path.
 ///////////////////////////////////////////////////////////////////////////////
-bool convolve2DSeparable(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX,
-    int kSizeX, const float* kernelY, int kSizeY)
-{
-    int i, j, k, m, n;
-    float *tmp, *sum;                // intermediate data buffer
-    float *inPtr, *outPtr;   // working pointers
-    float *tmpPtr, *tmpPtr2;         // working pointers
-    int kCenter, kOffset, endIndex;  // kernel indice
-
-    // check validity of params
-    if (!in || !out || !kernelX || !kernelY)
-        return false;
-    if (dataSizeX <= 0 || kSizeX <= 0)
-        return false;
+#define KERNEL_INT_MAX      16  // longest integer kernel
+#define KERNEL_INT_SHIFT    8   // max sx + sy of both kernels : the sums stay below 255 << 8
 
-    // allocate temp storage to keep intermediate result
-    //tmp = new float[dataSizeX * dataSizeY];
-    tmp = (float*)malloc(dataSizeX * dataSizeY * sizeof(float));
-    if (!tmp)
-        return false;  // memory allocation error
-
-    // store accumulated sum
-    //sum = new float[dataSizeX];
-    sum = (float*)malloc(dataSizeX * sizeof(float));
-    if (!sum)
-        return false;  // memory allocation error
-
-    // covolve horizontal direction ///////////////////////
-
-    // find center position of kernel (half of kernel size)
-    kCenter = kSizeX >> 1;           // center index of kernel array
-    endIndex = dataSizeX - kCenter;  // index for full kernel convolution
-
-    // init working pointers
-    inPtr = in;
-    tmpPtr = tmp;  // store intermediate results from 1D horizontal convolution
+/** @return s if k = ki / 2^s with non-negative integer taps summing to 2^s, -1 otherwise */
+static int kernel_int(const float* k, int kSize, uint16_t* ki)
+{
+    int s, m, sum;
 
-    // start horizontal convolution (x-direction)
-    for (i = 0; i < dataSizeY; ++i)  // number of rows
+    if (kSize > KERNEL_INT_MAX)
+        return -1;
+    for (s = 0; s <= KERNEL_INT_SHIFT; s++)
     {
-        kOffset = 0;  // starting index of partial kernel varies for each sample
-
-        // COLUMN FROM index=0 TO index=kCenter-1
-        for (j = 0; j < kCenter; ++j)
+        for (m = 0, sum = 0; m < kSize; m++)
         {
-            *tmpPtr = 0;  // init to 0 before accumulation
-
-            for (k = kCenter + kOffset, m = 0; k >= 0; --k, ++m)  // convolve with partial of kernel
-            {
-                *tmpPtr += *(inPtr + m) * kernelX[k];
-            }
-            ++tmpPtr;   // next output
-            ++kOffset;  // increase starting index of kernel
-        }
-
-        // COLUMN FROM index=kCenter TO index=(dataSizeX-kCenter-1)
-        for (j = kCenter; j < endIndex; ++j)
-        {
-            *tmpPtr = 0;  // init to 0 before accumulate
-
-            for (k = kSizeX - 1, m = 0; k >= 0; --k, ++m)  // full kernel
-            {
-                *tmpPtr += *(inPtr + m) * kernelX[k];
-            }
-            ++inPtr;   // next input
-            ++tmpPtr;  // next output
+            const float t = k[m] * (1 << s);
+            if (t < 0 || t != (float)(int)t)
+                break;
+            ki[m] = (uint16_t)t;
+            sum += ki[m];
         }
+        if (m == kSize)
+            return sum == 1 << s ? s : -1;
+    }
+    return -1;
+}
 
-        kOffset = 1;  // ending index of partial kernel varies for each sample
+/** out += in * k over n columns */
+static void convMac16(const uint16_t* restrict in, uint16_t* restrict out, int n, uint16_t k)
+{
+    int j;
 
-        // COLUMN FROM index=(dataSizeX-kCenter) TO index=(dataSizeX-1)
-        for (j = endIndex; j < dataSizeX; ++j)
-        {
-            *tmpPtr = 0;  // init to 0 before accumulation
+    for (j = 0; j < n; j++)
+        out[j] += in[j] * k;
+}
 
-            for (k = kSizeX - 1, m = 0; k >= kOffset; --k, ++m)  // convolve with partial of kernel
-            {
-                *tmpPtr += *(inPtr + m) * kernelX[k];
-            }
-            ++inPtr;    // next input
-            ++tmpPtr;   // next output
-            ++kOffset;  // increase ending index of partial kernel
-        }
+/** out += in[j - kCenter + m] * k for the columns j where the input is in the row (tap m of kSize) */
+static void convTap16(const uint16_t* in, uint16_t* out, int n, int m, int kSize, uint16_t k)
+{
+    const int kCenter = kSize >> 1;
+    const int j0 = m < kCenter ? kCenter - m : 0;
+    const int j1 = m > kCenter ? n - (m - kCenter) : n;
 
-        inPtr += kCenter;  // next row
-    }
-    // END OF HORIZONTAL CONVOLUTION //////////////////////
+    if (j1 > j0)
+        convMac16(in + j0 - kCenter + m, out + j0, j1 - j0, k);
+}
 
-    // start vertical direction ///////////////////////////
+/** out = in >> shift, in already holding the rounding */
+static void convShift16(const uint16_t* restrict in, unsigned char* restrict out, int n, int shift)
+{
+    int j;
 
-    // find center position of kernel (half of kernel size)
-    kCenter = kSizeY >> 1;           // center index of vertical kernel
-    endIndex = dataSizeY - kCenter;  // index where full kernel convolution should stop
+    for (j = 0; j < n; j++)
+        out[j] = (unsigned char)(in[j] >> shift);
+}
 
-    // set working pointers
-    tmpPtr = tmpPtr2 = tmp;
-    outPtr = out;
+/** conv5H of a uint8 row with a symmetric integer kernel */
+static void conv5H16(const unsigned char* restrict in, uint16_t* restrict out, int n, const uint16_t* k)
+{
+    const uint16_t k0 = k[0], k1 = k[1], k2 = k[2];
+    int j, m;
 
-    // clear out array before accumulation
-    for (i = 0; i < dataSizeX; ++i)
-        sum[i] = 0;
+    for (j = 0; j < n; j++)
+    {
+        uint16_t s = 0;
+        if (j == 2 && n > 4)
+            j = n - 2;
+        for (m = 0; m < 5; m++)
+            if (j + 2 - m >= 0 && j + 2 - m < n)
+                s += in[j + 2 - m] * k[m];
+        out[j] = s;
+    }
+    for (j = 2; j < n - 2; j++)
+        out[j] = k2 * in[j] + k1 * (in[j - 1] + in[j + 1]) + k0 * (in[j - 2] + in[j + 2]);
+}
 
-    // start to convolve vertical direction (y-direction)
+/** conv5V of 5 uint16 rows with a symmetric integer kernel, rounded and shifted into out */
+static void conv5V16(const uint16_t* const r[5], unsigned char* restrict out, int n, const uint16_t* k,
+                     uint16_t round, int shift)
+{
+    const uint16_t k0 = k[0], k1 = k[1], k2 = k[2];
+    const uint16_t* restrict a = r[0];
+    const uint16_t* restrict b = r[1];
+    const uint16_t* restrict c = r[2];
+    const uint16_t* restrict d = r[3];
+    const uint16_t* restrict e = r[4];
+    int i;
+
+    for (i = 0; i < n; i++)
+        out[i] = (unsigned char)((uint16_t)(round + k2 * c[i] + k1 * (b[i] + d[i]) + k0 * (a[i] + e[i])) >> shift);
+}
 
-    // ROW FROM index=0 TO index=(kCenter-1)
-    kOffset = 0;  // starting index of partial kernel varies for each sample
-    for (i = 0; i < kCenter; ++i)
+/** same as convSeparableRing for the 8-bit version, kernels ki / 2^sx and kj / 2^sy, work as convolve2DSeparableWorkSize */
+static void convSeparableRing16(const unsigned char* in, unsigned char* out, int dataSizeX, int dataSizeY,
+    const uint16_t* kernelX, int kSizeX, const uint16_t* kernelY, int kSizeY, int shift, float* work)
+{
+    const int kCenter = kSizeY >> 1;
+    const uint16_t round = shift ? 1 << (shift - 1) : 0;
+    uint16_t* ring = (uint16_t*)work;               // kSizeY rows of the horizontal pass
+    uint16_t* line = ring + kSizeY * dataSizeX;     // input row
+    uint16_t* sum = line + dataSizeX;               // vertical result (zero row of the 5-tap path)
+    const bool fold = kSizeX == 5 && kSizeY == 5 && kernelX[0] == kernelX[4] && kernelX[1] == kernelX[3]
+                      && kernelY[0] == kernelY[4] && kernelY[1] == kernelY[3];
+    int i, j, m, next = 0;
+
+    if (fold)
     {
-        for (k = kCenter + kOffset; k >= 0; --k)  // convolve with partial kernel
+        // binomial [1 4 6 4 1] like kernels : folded taps straight from / to uint8
+        const uint16_t* r[5];
+        memset(sum, 0, dataSizeX * sizeof(*sum));
+        for (i = 0; i < dataSizeY; ++i)
         {
-            for (j = 0; j < dataSizeX; ++j)
+            for (; next < dataSizeY && next <= i + 2; ++next)
+                conv5H16(in + next * dataSizeX, ring + (next % 5) * dataSizeX, dataSizeX, kernelX);
+            for (m = 0; m < 5; ++m)
             {
-                sum[j] += *tmpPtr * kernelY[k];
-                ++tmpPtr;
+                const int row = i - 2 + m;
+                r[m] = row >= 0 && row < dataSizeY ? ring + (row % 5) * dataSizeX : sum;
             }
+            conv5V16(r, out + i * dataSizeX, dataSizeX, kernelY, round, shift);
         }
-
-        for (n = 0; n < dataSizeX; ++n)  // convert and copy from sum to out
-        {
-            // covert negative to positive
-            *outPtr = (float)((float)fabs(sum[n]) + 0.5f);
-            sum[n] = 0;  // reset to zero for next summing
-            ++outPtr;    // next element of output
-        }
-
-        tmpPtr = tmpPtr2;  // reset input pointer
-        ++kOffset;         // increase starting index of kernel
+        return;
     }
 
-    // ROW FROM index=kCenter TO index=(dataSizeY-kCenter-1)
-    for (i = kCenter; i < endIndex; ++i)
+    for (i = 0; i < dataSizeY; ++i)
     {
-        for (k = kSizeY - 1; k >= 0; --k)  // convolve with full kernel
+        for (; next < dataSizeY && next <= i - kCenter + kSizeY - 1; ++next)
         {
+            uint16_t* dst = ring + (next % kSizeY) * dataSizeX;
             for (j = 0; j < dataSizeX; ++j)
-            {
-                sum[j] += *tmpPtr * kernelY[k];
-                ++tmpPtr;
-            }
+                line[j] = in[next * dataSizeX + j];
+            memset(dst, 0, dataSizeX * sizeof(*dst));
+            for (m = 0; m < kSizeX; ++m)
+                convTap16(line, dst, dataSizeX, m, kSizeX, kernelX[kSizeX - 1 - m]);
         }
 
-        for (n = 0; n < dataSizeX; ++n)  // convert and copy from sum to out
+        for (j = 0; j < dataSizeX; ++j)
+            sum[j] = round;
+        for (m = 0; m < kSizeY; ++m)
         {
-            // covert negative to positive
-            *outPtr = (float)((float)fabs(sum[n]) + 0.5f);
-            sum[n] = 0;  // reset for next summing
-            ++outPtr;    // next output
+            const int row = i - kCenter + m;
+            const uint16_t k = kernelY[kSizeY - 1 - m];
+            if (row < 0 || row >= dataSizeY)
+                continue;   // zero padding
+            convMac16(ring + (row % kSizeY) * dataSizeX, sum, dataSizeX, k);
         }
-
-        // move to next row
-        tmpPtr2 += dataSizeX;
-        tmpPtr = tmpPtr2;
+        convShift16(sum, out + i * dataSizeX, dataSizeX, shift);
     }
+}
 
-    // ROW FROM index=(dataSizeY-kCenter) TO index=(dataSizeY-1)
-    kOffset = 1;  // ending index of partial kernel varies for each sample
-    for (i = endIndex; i < dataSizeY; ++i)
-    {
-        for (k = kSizeY - 1; k >= kOffset; --k)  // convolve with partial kernel
-        {
-            for (j = 0; j < dataSizeX; ++j)
-            {
-                sum[j] += *tmpPtr * kernelY[k];
-                ++tmpPtr;
-            }
-        }
 
-        for (n = 0; n < dataSizeX; ++n)  // convert and copy from sum to out
-        {
-            // covert negative to positive
-            *outPtr = (float)((float)fabs(sum[n]) + 0.5f);
-            sum[n] = 0;  // reset for next summing
-            ++outPtr;    // next output
-        }
+///////////////////////////////////////////////////////////////////////////////
+// unsigned char (8-bit) version
+///////////////////////////////////////////////////////////////////////////////
+bool convolve2DSeparable8(unsigned char* in, unsigned char* out, int dataSizeX, int dataSizeY, 
+                         float* kernelX, int kSizeX, float* kernelY, int kSizeY)
+{
+    float *work;
+    bool ret;
+
+    if(dataSizeX <= 0 || dataSizeY <= 0 || kSizeY <= 0) return false;
+    work = (float*)malloc(convolve2DSeparableWorkSize(dataSizeX, kSizeY));
+    if(!work) return false;  // memory allocation error
+    ret = convolve2DSeparable8Buf(in, out, dataSizeX, dataSizeY, kernelX, kSizeX, kernelY, kSizeY, work);
+    free(work);
+    return ret;
+}
+
+bool convolve2DSeparable8Buf(unsigned char* in, unsigned char* out, int dataSizeX, int dataSizeY,
+                         float* kernelX, int kSizeX, float* kernelY, int kSizeY, float* work)
+{
+    // check validity of params
+    if(!in || !out || !kernelX || !kernelY || !work) return false;
+    if(dataSizeX <= 0 || dataSizeY <= 0 || kSizeX <= 0 || kSizeY <= 0) return false;
 
-        // move to next row
-        tmpPtr2 += dataSizeX;
-        tmpPtr = tmpPtr2;  // next input
-        ++kOffset;         // increase ending index of kernel
+    // binomial like kernels : integer path
+    uint16_t kx[KERNEL_INT_MAX], ky[KERNEL_INT_MAX];
+    const int sx = kernel_int(kernelX, kSizeX, kx), sy = kernel_int(kernelY, kSizeY, ky);
+    if (sx >= 0 && sy >= 0 && sx + sy <= KERNEL_INT_SHIFT)
+    {
+        convSeparableRing16(in, out, dataSizeX, dataSizeY, kx, kSizeX, ky, kSizeY, sx + sy, work);
+        return true;
     }
-    // END OF VERTICAL CONVOLUTION ////////////////////////
 
-    // deallocate temp buffers
-    /*delete[] tmp;
-    delete[] sum;*/
-    free(tmp); free(sum);
+    convSeparableRing(NULL, in, NULL, out, dataSizeX, dataSizeY, kernelX, kSizeX, kernelY, kSizeY,
+                      0, dataSizeY, work);
     return true;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// 1D convolution vertical
+// float version
 ///////////////////////////////////////////////////////////////////////////////
-bool convV(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelY, int kSizeY)
+bool convolve2DSeparable(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX,
+    int kSizeX, const float* kernelY, int kSizeY)
 {
-    // check validity of params
-    if (!in || !out || !kernelY)
-        return false;
-    if (dataSizeX <= 0)
-        return false;
+    float *work;
+    bool ret;
 
-    // Save temporary horizontal convolution for the entire image
-    int N = dataSizeX * dataSizeY;
-    //float* tmpx = new float[N];
-    float *tmpx = (float*)calloc(N, sizeof(float));
-    if (!tmpx)
-        return false;  // memory allocation error
-    //for (int i = 0; i < N; ++i)
-    //   tmpx[i] = 0;
-
-    // Save temporary vertical convolution for one row
-    //float* tmpsum = new float[dataSizeX];
-    float *tmpsum = (float*)calloc(dataSizeX, sizeof(float));
-    if (!tmpsum)
+    if (dataSizeX <= 0 || dataSizeY <= 0 || kSizeY <= 0)
+        return false;
+    work = (float*)malloc(convolve2DSeparableWorkSize(dataSizeX, kSizeY));
+    if (!work)
         return false;  // memory allocation error
-    //for (int i = 0; i < dataSizeX; ++i)
-      //  tmpsum[i] = 0;
+    ret = convolve2DSeparableBuf(in, out, dataSizeX, dataSizeY, kernelX, kSizeX, kernelY, kSizeY, work);
+    free(work);
+    return ret;
+}
 
-    // find center position of kernel (half of kernel size)
-    int kCenter = kSizeY >> 1;           // center index of kernel array
-    int endIndex = dataSizeX - kCenter;  // index for full kernel convolution
-    int right_half = kSizeY - kCenter - 1; // size of right half right to index 'kCenter' in the kernel
+bool convolve2DSeparableBuf(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX,
+    int kSizeX, const float* kernelY, int kSizeY, float* work)
+{
+    // check validity of params
+    if (!in || !out || !kernelX || !kernelY || !work)
+        return false;
+    if (dataSizeX <= 0 || dataSizeY <= 0 || kSizeX <= 0 || kSizeY <= 0)
+        return false;
 
-    kCenter = kSizeY >> 1;
-    endIndex = dataSizeY - kCenter;
-    right_half = kSizeY - kCenter - 1;
+    convSeparableRing(in, NULL, out, NULL, dataSizeX, dataSizeY, kernelX, kSizeX, kernelY, kSizeY,
+                      0, dataSizeY, work);
+    return true;
+}
 
-    // [0, kCenter - 1]
-    int offset = 0;
-    for (int j = 0; j < kCenter; ++j)
-    {
-        for (int k = kCenter + offset, row = 0; k >= 0; k--, row++)
-        {
-            for (int i = 0; i < dataSizeX; ++i)
-            {
-                int idx = row * dataSizeX + i;
-                tmpsum[i] += tmpx[idx] * kernelY[k];  // tmpsum is 1D row vector
-            }
-        }
-        offset++;
+///////////////////////////////////////////////////////////////////////////////
+// 1D convolution vertical
+///////////////////////////////////////////////////////////////////////////////
+bool convV(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelY, int kSizeY)
+{
+    float *work;
+    bool ret;
 
-        // Copy tmpSum result to final output image. One 1D row vector 'tmpsum'
-        // is enough and this can save storage.
-        for (int i = 0; i < dataSizeX; ++i)
-        {
-            int idx = j * dataSizeX + i;
-            out[idx] = (float)tmpsum[i] + 0.5f;
-            tmpsum[i] = 0;
-        }
-    }
-    // [kCenter, endIndex - 1]
-    for (int j = kCenter; j < endIndex; ++j)
-    {
-        for (int k = kSizeY - 1, m = 0; k >= 0; k--, m++)
-        {
-            int row = j - right_half + m;
-            for (int i = 0; i < dataSizeX; ++i)
-            {
-                int idx = row * dataSizeX + i;
-                tmpsum[i] += tmpx[idx] * kernelY[k];
-            }
-        }
-        for (int i = 0; i < dataSizeX; ++i)
-        {
-            int idx = j * dataSizeX + i;
-            out[idx] = (float)tmpsum[i] + 0.5f;
-            tmpsum[i] = 0;
-        }
-    }
+    if (dataSizeX <= 0)
+        return false;
+    work = (float*)malloc(dataSizeX * sizeof(float));
+    if (!work)
+        return false;  // memory allocation error
+    ret = convVBuf(in, out, dataSizeX, dataSizeY, kernelY, kSizeY, work);
+    free(work);
+    return ret;
+}
 
-    // [endIndex, dataSizeY - 1]
-    offset = 1;
-    for (int j = endIndex; j < dataSizeY; ++j)
-    {
-        for (int k = kSizeY - 1, m = 0; k >= offset; k--, m++)
-        {
-            int row = j - right_half + m;
-            for (int i = 0; i < dataSizeX; ++i)
-            {
-                int idx = row * dataSizeX + i;
-                tmpsum[i] += tmpx[idx] * kernelY[k];  // tmpsum is 1D row vector
-            }
-        }
-        offset++;
-        for (int i = 0; i < dataSizeX; ++i)
-        {
-            int idx = j * dataSizeX + i;
-            out[idx] =(float)tmpsum[i] + 0.5f;
-            tmpsum[i] = 0;
-        }
-    }
+bool convVBuf(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelY, int kSizeY, float* work)
+{
+    // check validity of params
+    if (!in || !out || !kernelY || !work)
+        return false;
+    if (dataSizeX <= 0 || kSizeY <= 0)
+        return false;
 
-    free(tmpx); free(tmpsum);
+    // the rows are read in place, work is the row of zeros out of the frame
+    for (int i = 0; i < dataSizeX; ++i)
+        work[i] = 0;
+    convVRows(in, out, dataSizeX, dataSizeY, kernelY, kSizeY, 0, dataSizeY, work);
     return true;
 }
 
@@ -510,6 +481,14 @@ bool convH(float* in, float* out, int dataSizeX, int dataSizeY, const float* ker
     if (dataSizeX <= 0 || kSizeX <= 0)
         return false;
 
+    const int type = kernel5_type(kernelX, kSizeX);
+    if (type != KERNEL_GENERIC)
+    {
+        for (i = 0; i < dataSizeY; ++i)
+            conv5H(in + i * dataSizeX, out + i * dataSizeX, dataSizeX, kernelX, type);
+        return true;
+    }
+
     // covolve horizontal direction ///////////////////////
 
     // find center position of kernel (half of kernel size)
@@ -572,4 +551,106 @@ bool convH(float* in, float* out, int dataSizeX, int dataSizeY, const float* ker
     // END OF HORIZONTAL CONVOLUTION //////////////////////
     
     return true;
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Band parallel versions
+// Each thread produces a band of output rows. The vertical passes read the kCenter
+// halo rows of the neighbour bands from the input (the 2D version filters them
+// horizontally again), so the bands only share read-only data.
+///////////////////////////////////////////////////////////////////////////////
+
+/** arguments of the bands of a convolution */
+typedef struct {
+    const float *in;
+    float *out;
+    int dataSizeX, dataSizeY;
+    const float *kernelX, *kernelY;
+    int kSizeX, kSizeY;
+    float *work;        // convolve2DSeparableWorkSize per band
+    size_t stride;      // floats between the work of 2 bands
+} ConvBands;
+
+static void convHBand(void* arg, int band, int y0, int y1)
+{
+    const ConvBands* c = (const ConvBands*)arg;
+    (void)band;
+    convH((float*)c->in + y0 * c->dataSizeX, c->out + y0 * c->dataSizeX, c->dataSizeX, y1 - y0,
+          c->kernelX, c->kSizeX);
+}
+
+static void convVBand(void* arg, int band, int y0, int y1)
+{
+    const ConvBands* c = (const ConvBands*)arg;
+    float* zero = c->work + band * c->stride;
+    int i;
+
+    for (i = 0; i < c->dataSizeX; ++i)
+        zero[i] = 0;
+    convVRows(c->in, c->out, c->dataSizeX, c->dataSizeY, c->kernelY, c->kSizeY, y0, y1, zero);
+}
+
+static void convolve2DSeparableBand(void* arg, int band, int y0, int y1)
+{
+    const ConvBands* c = (const ConvBands*)arg;
+    convSeparableRing(c->in, NULL, c->out, NULL, c->dataSizeX, c->dataSizeY, c->kernelX, c->kSizeX,
+                      c->kernelY, c->kSizeY, y0, y1, c->work + band * c->stride);
+}
+
+/** run func on the bands of exec, with the exec work or a temporary one if it needs some */
+static bool convExecRun(ConvBands* c, const ConvExec* exec, me_band_func func, bool needWork)
+{
+    const int threads = exec ? exec->threads : 1;
+    MEPool* pool = exec ? exec->pool : NULL;
+    const int bands = me_parallel_count(pool ? me_pool_threads(pool) : threads, c->dataSizeY);
+    float* work = NULL;
+
+    c->stride = convolve2DSeparableWorkSize(c->dataSizeX, c->kSizeY) / sizeof(float);
+    c->work = exec ? exec->work : NULL;
+    if (needWork && !c->work)
+    {
+        work = (float*)malloc(bands * c->stride * sizeof(float));
+        if (!work)
+            return false;  // memory allocation error
+        c->work = work;
+    }
+    if (pool)
+        me_parallel_tiles(pool, c->dataSizeY, 0, func, c);
+    else
+        me_parallel_bands(threads, c->dataSizeY, func, c);
+    free(work);
+    return true;
+}
+
+bool convHExec(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX, int kSizeX,
+    const ConvExec* exec)
+{
+    ConvBands c = {.in = in, .out = out, .dataSizeX = dataSizeX, .dataSizeY = dataSizeY,
+                   .kernelX = kernelX, .kSizeX = kSizeX, .kSizeY = 1};
+
+    if (!in || !out || !kernelX || dataSizeX <= 0 || dataSizeY <= 0 || kSizeX <= 0)
+        return false;
+    return convExecRun(&c, exec, &convHBand, false);
+}
+
+bool convVExec(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelY, int kSizeY,
+    const ConvExec* exec)
+{
+    ConvBands c = {.in = in, .out = out, .dataSizeX = dataSizeX, .dataSizeY = dataSizeY,
+                   .kernelY = kernelY, .kSizeY = kSizeY};
+
+    if (!in || !out || !kernelY || dataSizeX <= 0 || dataSizeY <= 0 || kSizeY <= 0)
+        return false;
+    return convExecRun(&c, exec, &convVBand, true);
+}
+
+bool convolve2DSeparableExec(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX,
+    int kSizeX, const float* kernelY, int kSizeY, const ConvExec* exec)
+{
+    ConvBands c = {.in = in, .out = out, .dataSizeX = dataSizeX, .dataSizeY = dataSizeY,
+                   .kernelX = kernelX, .kSizeX = kSizeX, .kernelY = kernelY, .kSizeY = kSizeY};
+
+    if (!in || !out || !kernelX || !kernelY || dataSizeX <= 0 || dataSizeY <= 0 || kSizeX <= 0 || kSizeY <= 0)
+        return false;
+    return convExecRun(&c, exec, &convolve2DSeparableBand, true);
+}
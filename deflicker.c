@@ -10,8 +10,8 @@
 #include <stdio.h>
 #include <assert.h>
 
+/** queue of deflicker() and get_factor(), the streams with their own queue use the _r versions */
 static queue_t queue = { .brightness = {0.0f}, .available = 0 };
-static queue_t *q = &queue;
 
 /** @brief Fast clipping */
 static uint8_t clip_uint8(int a)
@@ -35,7 +35,7 @@ float calc_brightness(uint8_t *img, int size) {
     return sum / (float)size;
 }
 
-float get_factor() {
+float get_factor_r(const queue_t *q) {
     int i;
     float sum = 0.0f;
     for( i = 0; i < MAXSIZE; i++) 
@@ -45,7 +45,11 @@ float get_factor() {
     return sum / q->brightness[MAXSIZE - 1];
 }
 
-bool deflicker(uint8_t *img, int w, int h) {
+float get_factor() {
+    return get_factor_r(&queue);
+}
+
+bool deflicker_r(queue_t *q, uint8_t *img, int w, int h) {
 
     const int size = w * h;
     float f = 0;
@@ -66,10 +70,14 @@ bool deflicker(uint8_t *img, int w, int h) {
         q->brightness[MAXSIZE - 1] = currBrightness;
     }
 
-    f = get_factor();
+    f = get_factor_r(q);
 
     for (i = 0; i < size; i++)
         img[i] = clip_uint8(img[i] * f);
 
     return true;
-}
\ No newline at end of file
+}
+
+bool deflicker(uint8_t *img, int w, int h) {
+    return deflicker_r(&queue, img, w, h);
+}
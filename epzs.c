@@ -8,6 +8,8 @@
 #include "motion.h"
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <sched.h>
 
 /** @brief if 1 will use FFMPEG version else it is from paper MPG4/AVC
  * @todo : Paper result are erratic
@@ -25,7 +27,7 @@ static inline int mid_pred(int a, int b, int c)
 #define COST_P_MV(x, y)\
 do {\
     if (x >= x_min && x <= x_max && y >= y_min && y <= y_max) {\
-        cost = me_ctx->get_cost(me_ctx, x_mb, y_mb, x, y);\
+        cost = me_ctx->get_cost_bounded(me_ctx, x_mb, y_mb, x, y, cost_min);\
         if (cost < cost_min) {\
             cost_min = cost;\
             mv[0] = x;\
@@ -34,6 +36,27 @@ do {\
     }\
 } while(0)
 
+/** @brief score the n candidates mvs in a single pass, keep the first minimum as COST_P_MV */
+#define COST_P_MVS(mvs, n)\
+do {\
+    int _k;\
+    me_ctx->get_cost_multi(me_ctx, x_mb, y_mb, mvs, n, cost_min, costs);\
+    for (_k = 0; _k < n; _k++) {\
+        if (costs[_k] < cost_min) {\
+            cost_min = costs[_k];\
+            mv[0] = mvs[_k][0];\
+            mv[1] = mvs[_k][1];\
+        }\
+    }\
+} while(0)
+
+/** @brief predictors of the block being searched, private to the thread searching it */
+typedef struct {
+    MotionEstPredictor preds[2];    ///< [0] : Set B (set 1), [1] : Set C (set 2)
+    int pred_x,                     ///< median predictor x in Set A
+        pred_y;                     ///< median predictor y in Set A
+} EPZSPredictors;
+
 #define ADD_PRED(preds, px, py)\
     do {\
         preds.mvs[preds.nb][0] = px;\
@@ -44,18 +67,18 @@ do {\
 /** 
  * @brief from https://github.com/FFmpeg/FFmpeg/tree/master/libavfilter
  *  two subsets of predictors are used
- *  me->pred_x|y is set to median of current frame's left, top, top-right
- *  set 1: me->preds[0] has: (0, 0), left, top, top-right, collocated block in prev frame
- *  set 2: me->preds[1] has: accelerator mv, top, left, right, bottom adj mb of prev frame
+ *  p->pred_x|y is set to median of current frame's left, top, top-right
+ *  set 1: p->preds[0] has: (0, 0), left, top, top-right, collocated block in prev frame
+ *  set 2: p->preds[1] has: accelerator mv, top, left, right, bottom adj mb of prev frame
  * 
  *  @note In OG article DOI: 10.15406/oajs.2017.01.00002 :
  *        three subsets of predictors are used
- *         - set A (me->pred_x|y): is set to median of current frame's left, top, top-right
+ *         - set A (p->pred_x|y): is set to median of current frame's left, top, top-right
  *         - set B (set 1): (0, 0), left, top, top-right
  *         - set C (set 2): collocated block in prev fram
  *         ffmpeg version seems to have better result though
  */
-static uint64_t me_search_epzs(MotionEstContext *me_ctx, int x_mb, int y_mb, int *mv)
+static uint64_t me_search_epzs(MotionEstContext *me_ctx, const EPZSPredictors *p, int x_mb, int y_mb, int *mv)
 {
     static const int8_t dia1[4][2]  = {{-1, 0}, { 0,-1}, { 1, 0}, { 0, 1}};
     int x, y;
@@ -64,9 +87,11 @@ static uint64_t me_search_epzs(MotionEstContext *me_ctx, int x_mb, int y_mb, int
     int x_max = mmin(x_mb + me_ctx->search_param, (me_ctx->b_width - 1) << me_ctx->log2_mbSize);
     int y_max = mmin(y_mb + me_ctx->search_param, (me_ctx->b_height - 1) << me_ctx->log2_mbSize);
     uint64_t cost, cost_min;
-    int i;
+    uint64_t costs[4];
+    int cand[4][2];
+    int i, n;
 
-    MotionEstPredictor *preds = me_ctx->preds;
+    const MotionEstPredictor *preds = p->preds;
 
     cost_min = UINT_FAST64_MAX;
 
@@ -78,7 +103,7 @@ static uint64_t me_search_epzs(MotionEstContext *me_ctx, int x_mb, int y_mb, int
     */
 
     // Set A  (median predictor)
-    COST_P_MV(x_mb + me_ctx->pred_x, y_mb + me_ctx->pred_y);
+    COST_P_MV(x_mb + p->pred_x, y_mb + p->pred_y);
 #if !FFMPEG
     if(cost_min < 256)
         return cost_min;
@@ -105,109 +130,184 @@ static uint64_t me_search_epzs(MotionEstContext *me_ctx, int x_mb, int y_mb, int
     do {
         x = mv[0];
         y = mv[1];
-        COST_P_MV(x + dia1[0][0], y + dia1[0][1]);
-        COST_P_MV(x + dia1[1][0], y + dia1[1][1]);
-        COST_P_MV(x + dia1[2][0], y + dia1[2][1]);
-        COST_P_MV(x + dia1[3][0], y + dia1[3][1]);
+        for (i = 0, n = 0; i < 4; i++) {
+            cand[n][0] = x + dia1[i][0];
+            cand[n][1] = y + dia1[i][1];
+            if (cand[n][0] >= x_min && cand[n][0] <= x_max && cand[n][1] >= y_min && cand[n][1] <= y_max)
+                n++;
+        }
+        COST_P_MVS(cand, n);
     } while (x != mv[0] || y != mv[1]);
 
     return cost_min;
 }
 
-bool motionEstEPZS(MotionEstContext *me_ctx)
+/** @brief predictor selection and search of block (mb_x, mb_y), vector stored in mv_table[0] */
+static void epzs_block(MotionEstContext *me_ctx, int mb_x, int mb_y)
+{
+    const int mb_i = mb_x + mb_y * me_ctx->b_width;
+    const int x_mb = mb_x << me_ctx->log2_mbSize;
+    const int y_mb = mb_y << me_ctx->log2_mbSize;
+    int mv[2] = {x_mb, y_mb};
+    EPZSPredictors p;
+
+    MotionEstPredictor *preds = p.preds;
+    preds[0].nb = 0;
+    preds[1].nb = 0;
+
+    //======================== Start predictor selection ===================================
+    /*-----------------------------    Set  B  -------------------------------------------*/
+    // (0,0) motion vextor for set B
+    ADD_PRED(preds[0], 0, 0);
+
+    //left mb in current frame
+    if (mb_x > 0)
+        ADD_PRED(preds[0], me_ctx->mv_table[0][mb_i - 1].vx, me_ctx->mv_table[0][mb_i - 1].vy);
+
+    //top mb in current frame
+    if (mb_y > 0) { 
+        ADD_PRED(preds[0], me_ctx->mv_table[0][mb_i - me_ctx->b_width].vx, me_ctx->mv_table[0][mb_i - me_ctx->b_width].vy);
+
+    //top-right mb in current frame
+    //if (mb_y > 0 && mb_x + 1 < me_ctx->b_width)
+        if ((mb_x + 1) < me_ctx->b_width)
+            ADD_PRED(preds[0], me_ctx->mv_table[0][mb_i - me_ctx->b_width + 1].vx, me_ctx->mv_table[0][mb_i - me_ctx->b_width + 1].vy);
+    }
+
+    /*-----------------------------    Set  A  -------------------------------------------*/
+    //median predictor
+    if (preds[0].nb == 4) {
+        //                             left         ,      top           ,    top-right
+        p.pred_x = mid_pred(preds[0].mvs[1][0], preds[0].mvs[2][0], preds[0].mvs[3][0]);
+        p.pred_y = mid_pred(preds[0].mvs[1][1], preds[0].mvs[2][1], preds[0].mvs[3][1]);
+    } else if (preds[0].nb == 3) {
+        p.pred_x = mid_pred(0, preds[0].mvs[1][0], preds[0].mvs[2][0]);
+        p.pred_y = mid_pred(0, preds[0].mvs[1][1], preds[0].mvs[2][1]);
+    } else if (preds[0].nb == 2) {
+        p.pred_x = preds[0].mvs[1][0];
+        p.pred_y = preds[0].mvs[1][1];
+    } else {
+        p.pred_x = 0;
+        p.pred_y = 0;
+    }
+
+    //collocated mb in prev frame
+    ADD_PRED(preds[0], me_ctx->mv_table[1][mb_i].vx, me_ctx->mv_table[1][mb_i].vy);
+
+    //collocated mb at the coarser pyramid level (hierarchical search)
+    if (me_ctx->coarse) {
+        const MotionEstContext *c = me_ctx->coarse;
+        const int c_i = mmin(mb_y >> 1, c->b_height - 1) * c->b_width + mmin(mb_x >> 1, c->b_width - 1);
+        ADD_PRED(preds[0], 2 * c->mv_table[0][c_i].vx, 2 * c->mv_table[0][c_i].vy);
+    }
+
+    /*-----------------------------    Set C   -------------------------------------------*/
+#if FFMPEG
+    /* @note: FFMPEG accelerator MV of collocated block in previous frame: $V_{t-1} + \delta V$
+     */
+    ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i].vx + (me_ctx->mv_table[1][mb_i].vx - me_ctx->mv_table[2][mb_i].vx),
+                        me_ctx->mv_table[1][mb_i].vy + (me_ctx->mv_table[1][mb_i].vy - me_ctx->mv_table[2][mb_i].vy));
+#else
+    //Paper version: C contains the motion vector of the collocated block in the previous fram : $V_{t-1}$
+    ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i].vx, me_ctx->mv_table[1][mb_i].vy);
+#endif
+    //left mb in prev frame
+    if (mb_x > 0)
+        ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i - 1].vx, me_ctx->mv_table[1][mb_i - 1].vy);
+
+    //top mb in prev frame
+    if (mb_y > 0)
+        ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i - me_ctx->b_width].vx, me_ctx->mv_table[1][mb_i - me_ctx->b_width].vy);
+
+    //right mb in prev frame
+    if (mb_x + 1 < me_ctx->b_width)
+        ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i + 1].vx, me_ctx->mv_table[1][mb_i + 1].vy);
+
+    //bottom mb in prev frame
+    if (mb_y + 1 < me_ctx->b_height)
+        ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i + me_ctx->b_width].vx, me_ctx->mv_table[1][mb_i + me_ctx->b_width].vy);
+    
+    
+    //======================== End predictor selection ===================================
+
+    me_search_epzs(me_ctx, &p, x_mb, y_mb, mv);
+    me_ctx->mv_table[0][mb_i].vx = (int16_t) mv[0] - x_mb;
+    me_ctx->mv_table[0][mb_i].vy = (int16_t) mv[1] - y_mb;
+    me_ctx->mv_table[0][mb_i].mag2 = (uint16_t) pow(mv[0] - x_mb,2) + pow(mv[1] - y_mb,2);
+    me_ctx->max = mmax(me_ctx->max, me_ctx->mv_table[0][mb_i].mag2);
+}
+
+/**
+ * @brief wavefront of motionEstEPZS : threads take the next block row to search
+ *
+ *  A block needs its left, top and top-right neighbours of the current frame, so row r
+ *  runs 2 blocks behind row r - 1. Row r publishes the raster index + 1 of its last searched
+ *  block in done[r % ME_THREADS_MAX] : no more than ME_THREADS_MAX rows are searched at once.
+ *  A row only waits for an older row being searched : the rows are handed out in order by the
+ *  next counter rather than as tiles of the pool, whose work stealing could leave the row above
+ *  unclaimed behind a waiting worker.
+ */
+typedef struct {
+    MotionEstContext *ctx;
+    atomic_int next;                ///< next row to search
+    atomic_int done[ME_THREADS_MAX];
+    int max[ME_THREADS_MAX];        ///< per worker
+    uint32_t cost_count[ME_THREADS_MAX], cost_aborted[ME_THREADS_MAX], sea_rejected[ME_THREADS_MAX];
+} EPZSWavefront;
+
+static void epzs_rows(void *arg, int t, int begin, int end)
 {
+    EPZSWavefront *wf = (EPZSWavefront*)arg;
+    // private copy : the cost statistics and max of the thread
+    MotionEstContext c = *wf->ctx;
     int mb_y, mb_x;
+    (void)begin; (void)end;
+
+    c.max = 0;
+    c.cost_count = c.cost_aborted = c.sea_rejected = 0;
+    while ((mb_y = atomic_fetch_add(&wf->next, 1)) < c.b_height) {
+        atomic_int *above = &wf->done[(mb_y + ME_THREADS_MAX - 1) % ME_THREADS_MAX];
+        for (mb_x = 0; mb_x < c.b_width; mb_x++) {
+            const int need = (mb_y - 1) * c.b_width + mmin(mb_x + 2, c.b_width);
+            while (mb_y > 0 && atomic_load_explicit(above, memory_order_acquire) < need)
+                sched_yield();
+            epzs_block(&c, mb_x, mb_y);
+            atomic_store_explicit(&wf->done[mb_y % ME_THREADS_MAX], mb_y * c.b_width + mb_x + 1, memory_order_release);
+        }
+    }
+    wf->max[t] = mmax(wf->max[t], c.max);
+    wf->cost_count[t] += c.cost_count;
+    wf->cost_aborted[t] += c.cost_aborted;
+    wf->sea_rejected[t] += c.sea_rejected;
+}
+
+bool motionEstEPZS(MotionEstContext *me_ctx)
+{
+    const int threads = me_parallel_count(me_pool_threads(me_ctx->pool), me_ctx->b_height);
+    int mb_y, mb_x, t, workers;
     me_ctx->max = 0;
 
     memcpy(me_ctx->mv_table[2], me_ctx->mv_table[1], sizeof(*me_ctx->mv_table[1]) * me_ctx->b_count);
     memcpy(me_ctx->mv_table[1], me_ctx->mv_table[0], sizeof(*me_ctx->mv_table[0]) * me_ctx->b_count);
 
-    for (mb_y = 0; mb_y < me_ctx->b_height; mb_y++) {
-        const int b_line = mb_y * me_ctx->b_width;
-        for (mb_x = 0; mb_x < me_ctx->b_width; mb_x++) {
-            const int mb_i = mb_x + b_line;
-            const int x_mb = mb_x << me_ctx->log2_mbSize;
-            const int y_mb = mb_y << me_ctx->log2_mbSize;
-            int mv[2] = {x_mb, y_mb};
-
-            MotionEstPredictor *preds = me_ctx->preds;
-            preds[0].nb = 0;
-            preds[1].nb = 0;
-
-            //======================== Start predictor selection ===================================
-            /*-----------------------------    Set  B  -------------------------------------------*/
-            // (0,0) motion vextor for set B
-            ADD_PRED(preds[0], 0, 0);
-
-            //left mb in current frame
-            if (mb_x > 0)
-                ADD_PRED(preds[0], me_ctx->mv_table[0][mb_i - 1].vx, me_ctx->mv_table[0][mb_i - 1].vy);
-
-            //top mb in current frame
-            if (mb_y > 0) { 
-                ADD_PRED(preds[0], me_ctx->mv_table[0][mb_i - me_ctx->b_width].vx, me_ctx->mv_table[0][mb_i - me_ctx->b_width].vy);
-
-            //top-right mb in current frame
-            //if (mb_y > 0 && mb_x + 1 < me_ctx->b_width)
-                if ((mb_x + 1) < me_ctx->b_width)
-                    ADD_PRED(preds[0], me_ctx->mv_table[0][mb_i - me_ctx->b_width + 1].vx, me_ctx->mv_table[0][mb_i - me_ctx->b_width + 1].vy);
-            }
-
-            /*-----------------------------    Set  A  -------------------------------------------*/
-            //median predictor
-            if (preds[0].nb == 4) {
-                //                             left         ,      top           ,    top-right
-                me_ctx->pred_x = mid_pred(preds[0].mvs[1][0], preds[0].mvs[2][0], preds[0].mvs[3][0]);
-                me_ctx->pred_y = mid_pred(preds[0].mvs[1][1], preds[0].mvs[2][1], preds[0].mvs[3][1]);
-            } else if (preds[0].nb == 3) {
-                me_ctx->pred_x = mid_pred(0, preds[0].mvs[1][0], preds[0].mvs[2][0]);
-                me_ctx->pred_y = mid_pred(0, preds[0].mvs[1][1], preds[0].mvs[2][1]);
-            } else if (preds[0].nb == 2) {
-                me_ctx->pred_x = preds[0].mvs[1][0];
-                me_ctx->pred_y = preds[0].mvs[1][1];
-            } else {
-                me_ctx->pred_x = 0;
-                me_ctx->pred_y = 0;
-            }
-
-            //collocated mb in prev frame
-            ADD_PRED(preds[0], me_ctx->mv_table[1][mb_i].vx, me_ctx->mv_table[1][mb_i].vy);
-
-            /*-----------------------------    Set C   -------------------------------------------*/
-#if FFMPEG
-            /* @note: FFMPEG accelerator MV of collocated block in previous frame: $V_{t-1} + \delta V$
-             */
-            ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i].vx + (me_ctx->mv_table[1][mb_i].vx - me_ctx->mv_table[2][mb_i].vx),
-                                me_ctx->mv_table[1][mb_i].vy + (me_ctx->mv_table[1][mb_i].vy - me_ctx->mv_table[2][mb_i].vy));
-#else
-            //Paper version: C contains the motion vector of the collocated block in the previous fram : $V_{t-1}$
-            ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i].vx, me_ctx->mv_table[1][mb_i].vy);
-#endif
-            //left mb in prev frame
-            if (mb_x > 0)
-                ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i - 1].vx, me_ctx->mv_table[1][mb_i - 1].vy);
-
-            //top mb in prev frame
-            if (mb_y > 0)
-                ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i - me_ctx->b_width].vx, me_ctx->mv_table[1][mb_i - me_ctx->b_width].vy);
-
-            //right mb in prev frame
-            if (mb_x + 1 < me_ctx->b_width)
-                ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i + 1].vx, me_ctx->mv_table[1][mb_i + 1].vy);
-
-            //bottom mb in prev frame
-            if (mb_y + 1 < me_ctx->b_height)
-                ADD_PRED(preds[1], me_ctx->mv_table[1][mb_i + me_ctx->b_width].vx, me_ctx->mv_table[1][mb_i + me_ctx->b_width].vy);
-            
-            
-            //======================== End predictor selection ===================================
-
-            me_search_epzs(me_ctx, x_mb, y_mb, mv);
-            me_ctx->mv_table[0][mb_i].vx = (int16_t) mv[0] - x_mb;
-            me_ctx->mv_table[0][mb_i].vy = (int16_t) mv[1] - y_mb;
-            me_ctx->mv_table[0][mb_i].mag2 = (uint16_t) pow(mv[0] - x_mb,2) + pow(mv[1] - y_mb,2);
-            me_ctx->max = mmax(me_ctx->max, me_ctx->mv_table[0][mb_i].mag2);
+    if (threads > 1) {
+        EPZSWavefront wf = {.ctx = me_ctx};
+        atomic_init(&wf.next, 0);
+        for (t = 0; t < ME_THREADS_MAX; t++)
+            atomic_init(&wf.done[t], 0);
+        // one tile per worker, each one searches rows until none is left
+        workers = me_parallel_tiles(me_ctx->pool, threads, 1, &epzs_rows, &wf);
+        for (t = 0; t < workers; t++) {
+            me_ctx->max = mmax(me_ctx->max, wf.max[t]);
+            me_ctx->cost_count += wf.cost_count[t];
+            me_ctx->cost_aborted += wf.cost_aborted[t];
+            me_ctx->sea_rejected += wf.sea_rejected[t];
         }
+        return 1;
     }
+
+    for (mb_y = 0; mb_y < me_ctx->b_height; mb_y++)
+        for (mb_x = 0; mb_x < me_ctx->b_width; mb_x++)
+            epzs_block(me_ctx, mb_x, mb_y);
     return 1;
-}
\ No newline at end of file
+}
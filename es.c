@@ -0,0 +1,130 @@
+/** @file es.c
+*   @brief Exhaustive search (full search) block matching, reference for ARPS/EPZS
+*   @author Thomas Pegot
+*/
+
+#include "motion.h"
+#include <math.h>
+
+/** @brief sum of each column over mbSize lines : col[x] = sum_{k < mbSize} img[k * linesize + x] */
+static void column_sums(const uint8_t *img, int linesize, int w, int mbSize, uint32_t *col) {
+    int x, k;
+
+    for (x = 0; x < w; x++)
+        col[x] = img[x];
+    for (k = 1; k < mbSize; k++) {
+        img += linesize;
+        for (x = 0; x < w; x++)
+            col[x] += img[x];
+    }
+}
+
+/** @brief move the column sums one line down : drop line `top`, add line `top + mbSize` */
+static void column_sums_slide(const uint8_t *top, int linesize, int w, int mbSize, uint32_t *col) {
+    const uint8_t *bottom = top + mbSize * linesize;
+    int x;
+
+    for (x = 0; x < w; x++)
+        col[x] += bottom[x] - top[x];
+}
+
+/** @brief lower bound of the SAD : \f$ \sum_c |\sum_k Cur_{kc} - \sum_k Ref_{kc}| \f$ */
+static inline uint32_t column_bound(const uint32_t *col_cur, const uint32_t *col_ref, int mbSize) {
+    uint32_t bound = 0;
+    int c;
+
+    for (c = 0; c < mbSize; c++)
+        bound += abs((int)col_cur[c] - (int)col_ref[c]);
+    return bound;
+}
+
+/** @brief keep the lowest cost, on equality the shortest vector so the result doesn't depend on scan order */
+static inline void es_update(MotionVector16_t *mv, uint32_t *best, uint64_t cost, int dx, int dy) {
+    const int mag2 = dx * dx + dy * dy;
+
+    if (cost < *best || (cost == *best && mag2 < mv->vx * mv->vx + mv->vy * mv->vy)) {
+        *best = (uint32_t)cost;
+        mv->vx = dx;
+        mv->vy = dy;
+    }
+}
+
+/** @brief score the n candidates of block (x_mb, y_mb) in one pass, limited to the current best cost */
+static void es_score(MotionEstContext *ctx, int x_mb, int y_mb, const int (*cand)[2], int n,
+                     MotionVector16_t *mv, uint32_t *best) {
+    uint64_t costs[4];
+    int k;
+
+    // +1 : a candidate as good as the best one is not aborted
+    ctx->get_cost_multi(ctx, x_mb, y_mb, cand, n, (uint64_t)*best + 1, costs);
+    for (k = 0; k < n; k++)
+        es_update(mv, best, costs[k], cand[k][0] - x_mb, cand[k][1] - y_mb);
+}
+
+bool motionEstES(MotionEstContext *ctx) {
+    const int linesize = ctx->width;
+    const int mbSize = ctx->mbSize;
+    const int p = ctx->search_param;
+    const int w = ctx->b_width << ctx->log2_mbSize;
+    const int x_last = (ctx->b_width - 1) << ctx->log2_mbSize;
+    const int y_last = (ctx->b_height - 1) << ctx->log2_mbSize;
+    uint32_t *col_cur = ctx->es_cols;
+    uint32_t *col_ref = col_cur + w;
+    uint32_t *best = col_ref + w;
+    int cand[4][2];
+    int mb_x, mb_y, x, y, n;
+
+    ctx->max = 0;
+    for (mb_y = 0; mb_y < ctx->b_height; mb_y++) {
+        const int y_mb = mb_y << ctx->log2_mbSize;
+        const int y_min = mmax(0, y_mb - p);
+        const int y_max = mmin(y_mb + p, y_last);
+        MotionVector16_t *mvs = ctx->mv_table[0] + mb_y * ctx->b_width;
+
+        // zero vector first : gives the tightest limit for most blocks
+        for (mb_x = 0; mb_x < ctx->b_width; mb_x++) {
+            const int x_mb = mb_x << ctx->log2_mbSize;
+            best[mb_x] = ctx->get_cost(ctx, x_mb, y_mb, x_mb, y_mb);
+            mvs[mb_x].vx = mvs[mb_x].vy = 0;
+        }
+
+        column_sums(ctx->data_cur + y_mb * linesize, linesize, w, mbSize, col_cur);
+        column_sums(ctx->data_ref + y_min * linesize, linesize, w, mbSize, col_ref);
+
+        // candidates line by line : the column sums of the reference follow the line
+        for (y = y_min; ; y++) {
+            for (mb_x = 0; mb_x < ctx->b_width; mb_x++) {
+                const int x_mb = mb_x << ctx->log2_mbSize;
+                const int x_min = mmax(0, x_mb - p);
+                const int x_max = mmin(x_mb + p, x_last);
+
+                for (x = x_min, n = 0; x <= x_max; x++) {
+                    if (x == x_mb && y == y_mb)
+                        continue;
+                    // an equal bound is kept for the tie-break of es_update
+                    if (column_bound(col_cur + x_mb, col_ref + x, mbSize) > best[mb_x]) {
+                        ctx->sea_rejected++;
+                        continue;
+                    }
+                    cand[n][0] = x;
+                    cand[n][1] = y;
+                    if (++n == 4) {
+                        es_score(ctx, x_mb, y_mb, cand, n, &mvs[mb_x], &best[mb_x]);
+                        n = 0;
+                    }
+                }
+                if (n)
+                    es_score(ctx, x_mb, y_mb, cand, n, &mvs[mb_x], &best[mb_x]);
+            }
+            if (y == y_max)
+                break;
+            column_sums_slide(ctx->data_ref + y * linesize, linesize, w, mbSize, col_ref);
+        }
+
+        for (mb_x = 0; mb_x < ctx->b_width; mb_x++) {
+            mvs[mb_x].mag2 = (uint16_t)(mvs[mb_x].vx * mvs[mb_x].vx + mvs[mb_x].vy * mvs[mb_x].vy);
+            ctx->max = mmax(ctx->max, mvs[mb_x].mag2);
+        }
+    }
+    return 1;
+}
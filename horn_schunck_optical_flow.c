@@ -0,0 +1,208 @@
+/** @file horn_schunck_optical_flow.c
+*   @brief Horn-Schunck dense optical flow solved by cascadic multigrid with red-black SOR
+*
+*   @author Thomas Pegot
+*/
+
+#include "motion.h"
+#include "convolution.h"
+#include <stdbool.h>
+#include <math.h>
+#include <string.h>
+#include "esp_timer.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "HS_OPTICAL_FLOW";
+#endif
+
+/** max number of grids (full resolution included) */
+#define HS_LEVELS 4
+
+/** a grid is not decimated below this size */
+#define HS_MIN_SIZE 16
+
+/** SOR over-relaxation factor (1 : Gauss-Seidel) */
+#define HS_OMEGA 1.8f
+
+/** default smoothness weight alpha */
+#define HS_ALPHA 15.0f
+
+/** default red-black sweeps on the finest grid */
+#define HS_ITERATIONS 6
+
+/** One grid of the multigrid : data term and flow */
+typedef struct {
+	int w, h;
+	float *J;		///< motion tensor per pixel : Ix², IxIy, Iy², IxIt, IyIt
+	float *u, *v;	///< flow
+} HSLevel;
+
+/** @brief grids : full resolution then halved while large enough
+ *  @return number of grids, *size receives the floats of all grids (tensor and flow)
+ */
+static int hs_grids(int w, int h, HSLevel *lvl, size_t *size) {
+	int n, l;
+
+	lvl[0].w = w; lvl[0].h = h;
+	for (n = 1; n < HS_LEVELS && (lvl[n - 1].w >> 1) >= HS_MIN_SIZE && (lvl[n - 1].h >> 1) >= HS_MIN_SIZE; n++) {
+		lvl[n].w = lvl[n - 1].w >> 1;
+		lvl[n].h = lvl[n - 1].h >> 1;
+	}
+	*size = 0;
+	for (l = 0; l < n; l++)
+		*size += 7 * (size_t)lvl[l].w * lvl[l].h;
+	return n;
+}
+
+size_t me_hs_memory(int w, int h) {
+	HSLevel lvl[HS_LEVELS];
+	size_t size;
+
+	hs_grids(w, h, lvl, &size);
+	// grids, then the mean image, its gradients and the convolution row
+	return (size + 3 * (size_t)w * h + w) * sizeof(float);
+}
+
+/** @brief coarse tensor = mean of the 2x2 fine tensors */
+static void hs_restrict(const HSLevel *f, HSLevel *c) {
+	int x, y, k;
+
+	for (y = 0; y < c->h; y++)
+		for (x = 0; x < c->w; x++) {
+			const float *J0 = f->J + 5 * (2 * y * f->w + 2 * x), *J1 = J0 + 5 * f->w;
+			float *J = c->J + 5 * (y * c->w + x);
+			for (k = 0; k < 5; k++)
+				J[k] = 0.25f * (J0[k] + J0[k + 5] + J1[k] + J1[k + 5]);
+		}
+}
+
+/** @brief fine flow initialised from the coarse one (the flow is always in full resolution pixels) */
+static void hs_prolong(const HSLevel *c, HSLevel *f) {
+	int x, y;
+
+	for (y = 0; y < f->h; y++) {
+		const int yc = mmin(y >> 1, c->h - 1);
+		for (x = 0; x < f->w; x++) {
+			const int i = yc * c->w + mmin(x >> 1, c->w - 1);
+			f->u[y * f->w + x] = c->u[i];
+			f->v[y * f->w + x] = c->v[i];
+		}
+	}
+}
+
+/**
+ * @brief one red-black SOR sweep of the Horn-Schunck Euler-Lagrange equations
+ *
+ *  \f[ (J_{11} + \alpha^2) u + J_{12} v = \alpha^2 \bar u - J_{13} \f]
+ *  \f[ J_{12} u + (J_{22} + \alpha^2) v = \alpha^2 \bar v - J_{23} \f]
+ *  with \f$ \bar u \f$ the mean of the 4 neighbours (reflecting border)
+ */
+static void hs_sweep(HSLevel *l, float alpha2) {
+	const int w = l->w, h = l->h;
+	int x, y, color;
+
+	for (color = 0; color < 2; color++)
+		for (y = 0; y < h; y++)
+			for (x = (y + color) & 1; x < w; x += 2) {
+				const int i = y * w + x;
+				const float *J = l->J + 5 * i;
+				float su = 0, sv = 0, n = 0;
+
+				if (x > 0)     { su += l->u[i - 1]; sv += l->v[i - 1]; n++; }
+				if (x < w - 1) { su += l->u[i + 1]; sv += l->v[i + 1]; n++; }
+				if (y > 0)     { su += l->u[i - w]; sv += l->v[i - w]; n++; }
+				if (y < h - 1) { su += l->u[i + w]; sv += l->v[i + w]; n++; }
+
+				const float a = J[0] + alpha2, b = J[1], c = J[2] + alpha2;
+				const float r1 = alpha2 * su / n - J[3];
+				const float r2 = alpha2 * sv / n - J[4];
+				const float det = a * c - b * b;
+				l->u[i] += HS_OMEGA * ((c * r1 - b * r2) / det - l->u[i]);
+				l->v[i] += HS_OMEGA * ((a * r2 - b * r1) / det - l->v[i]);
+			}
+}
+
+bool HS_optical_flow(MotionEstContext *ctx) {
+	const int w = ctx->width;
+	const int h = ctx->height;
+	const int N = w * h;
+	const int64_t start = esp_timer_get_time();
+	const float alpha = ctx->hs_alpha > 0 ? ctx->hs_alpha : HS_ALPHA;
+	const int iterations = ctx->hs_iterations > 0 ? ctx->hs_iterations : HS_ITERATIONS;
+	HSLevel lvl[HS_LEVELS];
+	float *buf = (float*)ctx->workspace;
+	float *image, *fx, *fy;
+	size_t size;
+	bool timeout = false;
+	int i, l, n, it;
+
+	ctx->max = 0;
+	ctx->hs_sweeps = 0;
+
+	n = hs_grids(w, h, lvl, &size);
+	for (l = 0; l < n; l++) {
+		lvl[l].J = buf;
+		lvl[l].u = buf + 5 * lvl[l].w * lvl[l].h;
+		lvl[l].v = lvl[l].u + lvl[l].w * lvl[l].h;
+		buf = lvl[l].v + lvl[l].w * lvl[l].h;
+	}
+	image = buf;
+	fx = image + N;
+	fy = fx + N;
+
+	/* spatial gradients of the mean of both frames, same convolution as Lucas Kanade */
+	for(i = N; i--; )
+		image[i] = 0.5f * (ctx->data_ref[i] + ctx->data_cur[i]);
+	if(!convH(image, fx, w, h, Kernel_Dxy, KERNEL_DXY_SIZE) || !convVBuf(image, fy, w, h, Kernel_Dxy, KERNEL_DXY_SIZE, fy + N)) {
+		ESP_LOGE(TAG, "convolution failed!");
+		return false;
+	}
+	for(i = 0; i < N; i++) {
+		const float It = (float)ctx->data_cur[i] - ctx->data_ref[i];
+		float *J = lvl[0].J + 5 * i;
+		J[0] = fx[i] * fx[i];
+		J[1] = fx[i] * fy[i];
+		J[2] = fy[i] * fy[i];
+		J[3] = fx[i] * It;
+		J[4] = fy[i] * It;
+	}
+
+	for (l = 1; l < n; l++)
+		hs_restrict(&lvl[l - 1], &lvl[l]);
+
+	/* cascadic multigrid : coarse grids converge in a few cheap sweeps and initialise the finer ones */
+	memset(lvl[n - 1].u, 0, 2 * lvl[n - 1].w * lvl[n - 1].h * sizeof(float));
+	for (l = n - 1; l >= 0; l--) {
+		// a grid 2x coarser sees the smoothness term 4x stronger : alpha_l² = alpha² / 4^l
+		const float alpha2 = alpha * alpha / (float)(1 << (2 * l));
+		// coarse sweeps are 4x cheaper, twice as many are done per level.
+		// Once the budget is exhausted finer grids only get one sweep to smooth the prolongation
+		const int sweeps = timeout ? 1 : iterations << l;
+
+		if (l < n - 1)
+			hs_prolong(&lvl[l + 1], &lvl[l]);
+		for (it = 0; it < sweeps; it++) {
+			hs_sweep(&lvl[l], alpha2);
+			ctx->hs_sweeps++;
+			if (!timeout && ctx->hs_time_budget && esp_timer_get_time() - start > ctx->hs_time_budget) {
+				timeout = true;
+				break;
+			}
+		}
+	}
+
+	for(i = 0; i < N; i++) {
+		const float vx = lvl[0].u[i], vy = lvl[0].v[i];
+		MotionVector16_t *mv = &ctx->mv_table[0][i];
+		mv->vx = (int16_t)lroundf(vx);
+		mv->vy = (int16_t)lroundf(vy);
+		mv->mag2 = (uint16_t)(vx * vx + vy * vy);
+		if(ctx->max < mv->mag2)
+			ctx->max = mv->mag2;
+	}
+	return true;
+}
@@ -7,6 +7,16 @@
 extern "C" {
 #endif
 #include <stdbool.h>
+#include <stddef.h>
+#include "parallel.h"
+
+/** size of Kernel_Dxy */
+#define KERNEL_DXY_SIZE 5
+
+/** Derivative kernel of the optical flow gradients (Lucas Kanade and Horn Schunck)
+*   https://www.cs.toronto.edu/~fleet/research/Papers/ijcv-94.pdf
+*/
+extern const float Kernel_Dxy[KERNEL_DXY_SIZE];
 
 /** Horizontal 1D convolution*/
 bool convH(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX, int kSizeX);
@@ -14,6 +24,17 @@ bool convH(float* in, float* out, int dataSizeX, int dataSizeY, const float* ker
 /** Vertical 1D convolution*/
 bool convV(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelY, int kSizeY);
 
+/** Vertical 1D convolution without allocation
+*   @param work scratch of dataSizeX floats
+*/
+bool convVBuf(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelY, int kSizeY, float* work);
+
+/** size in bytes of the work buffer of convolve2DSeparableBuf / convolve2DSeparable8Buf :
+*   a ring of kSizeY rows of the horizontal pass and 3 scratch rows, whatever the frame height
+*/
+#define convolve2DSeparableWorkSize(dataSizeX, kSizeY) \
+    ((size_t)(dataSizeX) * ((kSizeY) + 3) * sizeof(float))
+
 /** composite 2D convolution
 *   @param in float* image
 *   @return big if true
@@ -21,13 +42,62 @@ bool convV(float* in, float* out, int dataSizeX, int dataSizeY, const float* ker
 bool convolve2DSeparable(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX,
     int kSizeX, const float* kernelY, int kSizeY);
 
+/** composite 2D convolution without allocation
+*   @param work scratch of convolve2DSeparableWorkSize bytes
+*   @return big if true
+*/
+bool convolve2DSeparableBuf(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX,
+    int kSizeX, const float* kernelY, int kSizeY, float* work);
+
 /** 8bit version composite 2D convolution
+*
+*   Kernels k = ki / 2^s of non-negative integer taps summing to 2^s (sx + sy <= 8), like the binomial
+*   [1 4 6 4 1] / 16, are applied in integers (uint16 sums, round half up), same bytes as in float.
 *   @param in uint8* image
 *   @return big if true
 */
 bool convolve2DSeparable8(unsigned char* in, unsigned char* out, int dataSizeX, int dataSizeY, 
                          float* kernelX, int kSizeX, float* kernelY, int kSizeY);
 
+/** 8bit version composite 2D convolution without allocation
+*   @param work scratch of convolve2DSeparableWorkSize bytes
+*   @return big if true
+*/
+bool convolve2DSeparable8Buf(unsigned char* in, unsigned char* out, int dataSizeX, int dataSizeY,
+                         float* kernelX, int kSizeX, float* kernelY, int kSizeY, float* work);
+
+/** execution context of the band parallel convolutions */
+typedef struct {
+    int threads;    ///< bands of rows run in parallel, caller included (0 or 1 : serial, max ME_THREADS_MAX)
+    float *work;    ///< convExecWorkSize bytes, NULL : allocated by each call
+    MEPool *pool;   ///< NULL : threads started by each call, else bands run by the workers of the pool (work sized for threads >= its workers)
+} ConvExec;
+
+/** size in bytes of ConvExec.work : the scratch of convolve2DSeparableBuf for each band */
+#define convExecWorkSize(dataSizeX, kSizeY, threads) \
+    ((size_t)me_threads(threads) * convolve2DSeparableWorkSize(dataSizeX, kSizeY))
+
+/** Horizontal 1D convolution, bands of rows in parallel
+*   @param exec threads and scratch (NULL : serial)
+*   @return big if true
+*/
+bool convHExec(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX, int kSizeX,
+    const ConvExec* exec);
+
+/** Vertical 1D convolution, bands of rows in parallel (halo rows read in the input)
+*   @param exec threads and scratch (NULL : serial)
+*   @return big if true
+*/
+bool convVExec(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelY, int kSizeY,
+    const ConvExec* exec);
+
+/** composite 2D convolution, bands of rows in parallel (halo rows filtered horizontally by both bands)
+*   @param exec threads and scratch (NULL : serial)
+*   @return big if true, same result as convolve2DSeparable
+*/
+bool convolve2DSeparableExec(float* in, float* out, int dataSizeX, int dataSizeY, const float* kernelX,
+    int kSizeX, const float* kernelY, int kSizeY, const ConvExec* exec);
+
 #ifdef __cplusplus
 }
 #endif
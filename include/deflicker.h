@@ -22,12 +22,21 @@ typedef struct queue {
 */
 float get_factor();
 
+/** @brief get_factor of the queue q */
+float get_factor_r(const queue_t *q);
+
 /** @brief perform deflickering
 *   @param img uint8 pointer to image
 *   @param w width
 *   @param h height
 *   @return true if deflickering else return false (not enough image queued)
+*   @note one queue shared by all the calls : a single stream, deflicker_r for several
 */
 bool deflicker(uint8_t *img, int w, int h);
 
+/** @brief deflicker with the brightness queue q of the stream (zero initialised), reentrant
+*   @return true if deflickering else return false (not enough image queued)
+*/
+bool deflicker_r(queue_t *q, uint8_t *img, int w, int h);
+
 #endif
@@ -13,6 +13,8 @@ extern "C"{
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include "sad.h"
+#include "parallel.h"
 
 /** @brief return max as the same type of input */
 #define mmax(a,b) \
@@ -37,6 +39,22 @@ extern "C"{
 #define LK_OPTICAL_FLOW 	1
 #define BLOCK_MATCHING_ARPS	2
 #define BLOCK_MATCHING_EPZS     3
+#define BLOCK_MATCHING_PYRAMID  4
+#define BLOCK_MATCHING_ES       5
+#define PHASE_CORRELATION       6
+#define HS_OPTICAL_FLOW         7
+#define LK_OPTICAL_FLOW_FIXED   8
+/** @} */
+
+/**
+ * @name Sub-pixel refinement (MotionEstContext.subpel, .subpel_filter)
+ * @{
+ */
+#define SUBPEL_NONE     0
+#define SUBPEL_HALF     1
+#define SUBPEL_QUARTER  2
+#define SUBPEL_BILINEAR 0
+#define SUBPEL_6TAP     1
 /** @} */
 	
 typedef struct { int16_t x, y; } Vector16_t;
@@ -51,6 +69,16 @@ typedef struct {
     uint16_t mag2;   /*!< Squared magnitude $mag2 = vx^2 + vy^2$*/
 } MotionVector16_t;
 
+/**
+ * @struct MotionVectorQ16_t
+ * @brief MotionVector 2D in 1/4 pixel (fixed point, 2 fractional bits) from the sub-pixel refinement
+ */
+typedef struct {
+    int16_t  vx;	 /*!< 4 * vx in pixel */
+	int16_t  vy;	 /*!< 4 * vy in pixel */
+    uint16_t mag2;   /*!< Squared magnitude in pixel² (rounded) */
+} MotionVectorQ16_t;
+
 /** 
  * @struct MotionVector8_t
  * @brief MotionVector 2D 8bit
@@ -73,6 +101,9 @@ typedef struct MotionEstPredictor {
 /** 
  * @struct MotionEstContext
  *  @brief Exhaustive struct representing all parameter needed for all motion estimation type 
+ *
+ *  A context must start zeroed (designated initializer, `= {0}`, calloc or memset) : init_context
+ *  and uninit rely on `allocated` and on NULL table pointers to know what to free.
  */
 typedef struct MotionEstContext{	
 	char name[20];
@@ -80,6 +111,7 @@ typedef struct MotionEstContext{
 	        *data_ref;       			///< prev image
 	int method;		  					///< motion estimation method (LK_OPTICAL_FLOW, BLOCK_MATCHING_ARPS, ...)
 	int max;							///< max motion vector mag²
+	bool allocated;						///< tables allocated by init_context, freed by uninit
 	int width,							///< images width 
 	    height, 						///< images height
 	//	linewidth,						///< images width * depth (= width * 3 if rgb)	
@@ -91,31 +123,152 @@ typedef struct MotionEstContext{
 		b_height, 					    ///< blocks height
 		b_count;   	  					///< nb of blocks
 	
-	int mbSize,							///< macro block size
+	int mbSize,							///< macro block size (optical flow : cell size of mv_table[0], set by init_context)
 	    log2_mbSize; 					///< log2 of macro block size
+	int caller_mbSize;					///< mbSize set by the caller, restored by uninit when mbSize_saved
+	bool mbSize_saved;					///< init_context replaced mbSize by the optical flow cell size
 	int search_param; 					///< parameter p in ARPS
 
-	int pred_x,							///< median predictor x in Set A
-		pred_y;                         ///< median predictor y in Set A
-	MotionEstPredictor preds[2];		///< predictor for EPZS ([1] : Set B, [2] : Set C)
-
 	MotionVector16_t *mv_table[3];      ///< motion vectors of current & prev
 	/** @} */
 
+	/**
+	 * @name Hierarchical block matching (BLOCK_MATCHING_PYRAMID)
+	 * @{
+	 */
+	int pyr_levels;						///< number of levels including full resolution (2 or 3, default 3)
+	struct MotionEstContext *pyr;		///< pyr_levels - 1 EPZS contexts of the decimated frames (pyr[0] is 1/2)
+	uint8_t *pyr_buf;					///< decimated frames of all levels
+	const uint8_t *pyr_frame;			///< data_cur decimated in pyr, reused as reference on next call
+	struct MotionEstContext *coarse;	///< if set, EPZS adds the co-located vector of this level (x2) as predictor
+	/** @} */
+
+	/**
+	 * @name Sub-pixel refinement of block matching vectors
+	 * @{
+	 */
+	int subpel;							///< SUBPEL_NONE, SUBPEL_HALF or SUBPEL_QUARTER (set before init_context)
+	int subpel_filter;					///< half pixel interpolation : SUBPEL_BILINEAR or SUBPEL_6TAP (H.264 taps)
+	uint8_t *subpel_planes[3];			///< half pixel planes of data_ref : x + 1/2, y + 1/2, both
+	uint8_t *subpel_block;				///< quarter pixel block being scored (mbSize lines of width)
+	MotionVectorQ16_t *mvq_table;		///< refined vectors in 1/4 pixel, same order as mv_table[0]
+	/** @} */
+
+	uint32_t *es_cols;					///< BLOCK_MATCHING_ES : column sums of current and reference lines, best cost per block
+
+	/**
+	 * @name Lucas Kanade options (LK_OPTICAL_FLOW, LK_OPTICAL_FLOW_FIXED)
+	 * @{
+	 */
+	int lk_stride;						///< LK solved once per lk_stride x lk_stride cell (0 or 1 : every pixel), rounded to 2^n by init_context
+	bool lk_reuse;						///< use the mean of ref and cur gradients, cur ones kept for the next call (set before init_context)
+	int16_t *lk_grad;					///< 12 Ix then 12 Iy planes of lk_grad_frame (2 * width * height)
+	const uint8_t *lk_grad_frame;		///< frame of lk_grad, when it is the next data_ref only data_cur is differentiated
+	/** @} */
+
+	/**
+	 * @name Horn-Schunck (HS_OPTICAL_FLOW)
+	 * @{
+	 */
+	float hs_alpha;						///< smoothness weight alpha (0 : 15), larger gives smoother flow
+	int hs_iterations;					///< red-black sweeps on the full resolution grid (0 : 6), doubled on each coarser grid
+	int64_t hs_time_budget;				///< relaxation time budget in us (0 : iterations only)
+	int hs_sweeps;						///< sweeps done during last call (all grids)
+	/** @} */
+
+	/**
+	 * @name Phase correlation (PHASE_CORRELATION)
+	 * @{
+	 */
+	float pc_dx,						///< global shift x (sub-pixel), same convention as the block matching vectors
+	      pc_dy;						///< global shift y (sub-pixel)
+	float pc_peak;						///< height of the correlation peak in [0, 1], confidence of the global shift
+	int pc_size[2];						///< size of the centred window of the global shift (power of 2)
+	int pc_tw_n;						///< FFT size of the twiddles table
+	float *pc_buf;						///< FFT buffer, twiddles and Hann windows
+	/** @} */
+
+	/**
+	 * @name Threads
+	 * @{
+	 */
+	int threads;						///< threads of the parallel stages, caller included (0 or 1 : serial, max ME_THREADS_MAX), set before init_context
+	int tile_size;						///< rows of a tile given to a thread : block rows for ARPS (0 : 1), pixel rows for LK (0 : one share per thread)
+	MEPool *pool;						///< persistent workers started by init_context when threads > 1, stopped by uninit
+	/** @} */
+
+	/**
+	 * @name Workspace : scratch memory of the algorithms, motion_estimation doesn't allocate
+	 * @{
+	 */
+	void *workspace;					///< motion_query_memory bytes, allocated by init_context unless provided by the caller
+	size_t workspace_size;				///< size of a caller provided workspace (set before init_context)
+	bool workspace_owned;				///< workspace allocated by init_context, freed by uninit
+	/** @} */
+
+	me_sad_func sad;					///< SAD kernel selected by init_context for mbSize
+	me_sad_x4_func sad_x4;				///< 4 candidates SAD kernel selected by init_context for mbSize
+	me_sad_bounded_func sad_bounded;	///< bounded SAD kernel selected by init_context for mbSize
+
+	/**
+	 * @name Cost statistics, reset by each motion_estimation call
+	 * @{
+	 */
+	uint32_t cost_count;				///< number of block costs evaluated
+	uint32_t cost_aborted;				///< number of costs cut short by the partial distortion limit
+	/** @} */
+
+	/**
+	 * @name Successive Elimination Algorithm (block matching)
+	 * @{
+	 */
+	bool sea;							///< reject candidates with \f$ |\sum Cur - \sum Ref| \ge cost_{min} \f$ (set before init_context)
+	uint32_t *sum_table[2];				///< integral images of data_cur [0] and data_ref [1], (width+1)*(height+1)
+	const uint8_t *sum_frame;			///< frame used to build sum_table[0], reused as reference table on next call
+	uint32_t sea_rejected;				///< candidates rejected without computing the SAD during last call
+	/** @} */
+
 	/** pointer to motion estimation function */
 	uint64_t (*get_cost) (struct MotionEstContext *self, int x_mb, int y_mb, int x_mv, int y_mv);
+	/** pointer to bounded cost function (stops once the cost reaches limit) */
+	uint64_t (*get_cost_bounded) (struct MotionEstContext *self, int x_mb, int y_mb, int x_mv, int y_mv,
+								  uint64_t limit);
+	/** pointer to multi candidates cost function (same cost as get_cost_bounded for n positions) */
+	void (*get_cost_multi) (struct MotionEstContext *self, int x_mb, int y_mb, const int (*mv)[2], int n,
+							uint64_t limit, uint64_t *cost);
 	bool (*motion_func) (struct MotionEstContext *self);	
 } MotionEstContext;
 
+/**
+ * @brief Free what init_context allocated for ctx (and stop its workers)
+ *
+ *  All the state is in the context : contexts are independent, several can run in parallel.
+ *  ctx may be NULL. Only a context that started zeroed may be given (see MotionEstContext).
+ */
 void uninit(MotionEstContext *ctx);
 
 /** 
  * @brief Init & allocate context ctx accordingly to the method used 
+ *
+ *  ctx must start zeroed, only the parameters set by the caller. An initialized context can be
+ *  initialized again (after changing its parameters), what it held is freed first.
  * @param ctx : motion estimation context object
  * @return big if true
  */
 bool init_context(MotionEstContext *ctx);
 
+/**
+ * @brief Scratch memory needed by motion_estimation for ctx->method and the frame size
+ *
+ *  Temporaries of all the algorithms are carved from one workspace so motion_estimation
+ *  performs no heap allocation. init_context allocates it, unless ctx->workspace and
+ *  ctx->workspace_size are set by the caller to a buffer of at least this size.
+ *  Persistent tables (mv_table, pyramid, sub-pixel planes, ...) are not included.
+ * @param ctx : context with method, width and height set (search_param and threads for ARPS)
+ * @return size in bytes (0 if the method needs no workspace)
+ */
+size_t motion_query_memory(const MotionEstContext *ctx);
+
 /**
  * @brief motion estimation wrapper
  *  - Will update ctx->name representation of the motion estimation algo used.
@@ -154,8 +307,8 @@ bool motion_estimation(MotionEstContext *ctx, uint8_t *img_prev, uint8_t *img_cu
  * @brief omputes the Sum of Absolute Difference (SAD) for the given two blocks
  * \f[ SAD = \sum_{i=0}^{mbSize}\sum_{j=0}^{mbSize} |Cur_{ij}-Ref_{ij}| \f]
  * 
- *  Used as cost function for EPZS algorithm. 
- *  @todo Change ARPS algo such as it uses this function instead of its own
+ *  Used as cost function (ctx->get_cost) by EPZS and ARPS algorithm. 
+ *  The SAD itself is computed by the kernel ctx->sad selected at init_context (see sad.h).
  * 
  * @param me_ctx 
  * @param x_mb curr frame x located MB (MacroBlock)
@@ -166,6 +319,81 @@ bool motion_estimation(MotionEstContext *ctx, uint8_t *img_prev, uint8_t *img_cu
  */
 uint64_t me_comp_sad(MotionEstContext *me_ctx, int x_mb, int y_mb, int x_mv, int y_mv);
 
+/**
+ * @brief Same as me_comp_sad with partial distortion elimination
+ *
+ *  The SAD is accumulated line by line and the computation stops as soon as the partial
+ *  sum reaches `limit` (the block can't be the best anymore), see ME_SAD_ABORTED.
+ *  Used as ctx->get_cost_bounded by EPZS, me_ctx->cost_aborted counts the early exits.
+ *
+ * @param limit current best cost
+ * @return the SAD if < limit, otherwise a value >= limit
+ */
+uint64_t me_comp_sad_bounded(MotionEstContext *me_ctx, int x_mb, int y_mb, int x_mv, int y_mv, uint64_t limit);
+
+/**
+ * @brief Computes the SAD of one block against n candidate positions
+ *
+ *  Candidates are scored 4 by 4 with ctx->sad_x4 so the current block is read once per 4 positions.
+ *  Used as ctx->get_cost_multi by the EPZS refinement and the ARPS LDSP/SDSP patterns.
+ *
+ * @param me_ctx
+ * @param x_mb curr frame x located MB (MacroBlock)
+ * @param y_mb curr frame y located MB
+ * @param mv   n prev frame (x, y) located MB
+ * @param n    number of candidates
+ * @param limit current best cost, a group of 4 is cut short once all its costs reached it
+ * @param[out] cost n costs, cost[i] == me_comp_sad_bounded(me_ctx, x_mb, y_mb, mv[i][0], mv[i][1], limit)
+ */
+void me_comp_sad_multi(MotionEstContext *me_ctx, int x_mb, int y_mb, const int (*mv)[2], int n,
+                       uint64_t limit, uint64_t *cost);
+
+/**
+ * @brief Computes integral image (summed-area table) of img
+ * 
+ *  table[(y + 1) * (w + 1) + x + 1] is the sum of all pixels img[j * w + i] with i <= x and j <= y,
+ *  first line and column of table are 0.
+ * 
+ * @param img   grayscale image of size w * h
+ * @param table output of size (w + 1) * (h + 1)
+ * @param w     width
+ * @param h     height
+ */
+void integral_image(const uint8_t *img, uint32_t *table, int w, int h);
+
+/**
+ * @brief Set block size, allocate nb_tables mv_table and select the cost kernels.
+ *  Used by init_context for ARPS/EPZS and for the pyramid levels.
+ * @return big if true
+ */
+bool init_block_matching(MotionEstContext *ctx, int nb_tables);
+
+/** 
+ * @brief Allocate the decimated levels of BLOCK_MATCHING_PYRAMID, called by init_context
+ *
+ *  Levels too small for the macro block size (width <= 4 * mbSize or height < mbSize) are dropped.
+ * @return big if true, on failure the levels already allocated are freed
+ */
+bool me_pyramid_alloc(MotionEstContext *ctx);
+
+/** @brief Free what me_pyramid_alloc allocated (if anything), called by uninit */
+void me_pyramid_free(MotionEstContext *ctx);
+
+/** 
+ * @brief Allocate ctx->sum_table, called by init_context when ctx->sea is set
+ * @return big if true
+ */
+bool me_sea_alloc(MotionEstContext *ctx);
+
+/**
+ * @brief Build the SEA tables of data_cur and data_ref, called by motion_estimation
+ *
+ *  When data_ref is the data_cur of the previous call (same buffer) the previous current
+ *  table is reused as reference table so only one table is computed per frame.
+ *  Does nothing if the tables are not allocated.
+ */
+void me_sea_update(MotionEstContext *ctx);
+
 /**
  * @name Algorithm methods
  * @addtogroup ALGO_GROUP 
@@ -204,12 +432,51 @@ uint64_t me_comp_sad(MotionEstContext *me_ctx, int x_mb, int y_mb, int x_mv, int
 	\end{bmatrix} \f]
 	
  * Then the solution can be reduced as : \f$ A^T A v=A^T b \f$ or \f$ \mathrm{v}=(A^T A)^{-1}A^T b \f$
+ *
+ * With lk_reuse (NOSMOOTH) the spatial gradients are the mean of both frames' ones. The gradient planes of
+ * data_cur are kept in lk_grad, so when the next call's data_ref is this data_cur (same buffer)
+ * only the new frame is differentiated: the same cost as the reference only gradients.
+ *
+ * With threads > 1 the rows are split in tiles of tile_size rows (default one per thread) solved by the
+ * workers of ctx->pool (gradient and convolution stages included), each tile recomputing the gradients of
+ * its WINDOW / 2 halo rows: same output as serial.
  * @param me_ctx    Motion estimation context with me_ctx->method = 'LK_OPTICAL_FLOW'
  * 
  * @return          Big if True
  */
 bool LK_optical_flow(MotionEstContext *);
 
+/**
+ * @brief Lucas Kanade in fixed point for targets without (fast) FPU
+ *
+ *  Same algorithm and output as LK_optical_flow (NOSMOOTH) without any float : int16 gradients
+ *  computed row by row, structure tensor summed in int32 / int64 and the
+ *  eigenvalue test \f$ \lambda_2 \ge \tau \f$ done on det and trace.
+ *  Vectors are within 1 of the float version (both truncate, the integer division is exact
+ *  where float rounds), except where \f$ \lambda_2 \f$ is within rounding of the threshold.
+ *
+ * @param me_ctx    Motion estimation context with me_ctx->method = 'LK_OPTICAL_FLOW_FIXED'
+ * 
+ * @return          Big if True
+ */
+bool LK_optical_flow_fixed(MotionEstContext *);
+
+/**
+ * @brief Horn-Schunck dense optical flow
+ *
+ *  Minimise \f$ \sum (I_x V_x + I_y V_y + I_t)^2 + \alpha^2 (|\nabla V_x|^2 + |\nabla V_y|^2) \f$
+ *  so the flow is filled in untextured regions where LK has no solution. Gradients use the same
+ *  convH / convV stage as LK. The equations are relaxed by red-black SOR on up to 4 grids,
+ *  coarsest first, each solution initialising the next finer grid: a few sweeps per grid
+ *  replace hundreds of Jacobi iterations. The work is bounded by hs_iterations and
+ *  hs_time_budget. Output is one vector per pixel in mv_table[0] (rounded).
+ *
+ * @param me_ctx    Motion estimation context with me_ctx->method = 'HS_OPTICAL_FLOW'
+ * 
+ * @return          Big if True
+ */
+bool HS_optical_flow(MotionEstContext *);
+
 /**
  * @brief Lucas Kanade optical 8 bit version 
  *
@@ -226,9 +493,30 @@ bool LK_optical_flow(MotionEstContext *);
  */
 bool LK_optical_flow8(const uint8_t *src1, const uint8_t *src2, uint8_t *v, int w, int h);
 
+/**
+ * @brief LK_optical_flow8 without allocation
+ * @param work scratch of me_lk_memory(LK_OPTICAL_FLOW_8BIT, w, h, 1) bytes
+ * @return          Big if True
+ */
+bool LK_optical_flow8Buf(const uint8_t *src1, const uint8_t *src2, uint8_t *v, int w, int h, void *work);
+
+/** @brief workspace bytes of the Lucas Kanade methods (LK_OPTICAL_FLOW, LK_OPTICAL_FLOW_8BIT, LK_OPTICAL_FLOW_FIXED)
+ *  @param threads  ctx->threads (LK_OPTICAL_FLOW has one ring per thread)
+ */
+size_t me_lk_memory(int method, int w, int h, int threads);
+
+/** @brief workspace bytes of HS_OPTICAL_FLOW */
+size_t me_hs_memory(int w, int h);
+
+/** @brief workspace bytes of BLOCK_MATCHING_ARPS : the points checked by each worker, (2 * search_param + 1)² bytes */
+size_t me_arps_memory(int search_param, int threads);
+
 /**
  * @brief Perform Adaptive Rood Pattern Search algorithm
  * 
+ * With threads > 1 the workers of ctx->pool search tiles of tile_size block rows, each with its own
+ * search state : the vectors are the same as the serial scan.
+ * 
  * @param me_ctx    Motion estimation context with me_ctx->method = 'BLOCK_MATCHING_ARPS'
  * 
  * @return Big if true
@@ -244,28 +532,114 @@ bool motionEstARPS(MotionEstContext *) ;
  *         ffmpeg version of EPZS perform better than the one from the paper. The difference is
  *         related to the definition of predictors set A,B and C. More details in `me_search_eps` note.
  * 
+ * With threads > 1 the block rows are searched as a wavefront, each row 2 blocks behind the one above :
+ * the vectors are the same as the serial raster scan.
+ * 
  * @param me_ctx     Motion estimation context with me_ctx->method = 'BLOCK_MATCHING_EPZS'
  * 
  * @return           big if true 
  */
 bool motionEstEPZS(MotionEstContext *);
 
+/**
+ * @brief Exhaustive search : every vector of the window \f$ [-p, p]^2 \f$ is checked
+ *
+ *  The result is the minimum SAD (shortest vector on equality), to be used as ground truth
+ *  for ARPS / EPZS. Candidates are rejected without SAD when the column sums bound
+ *  \f$ \sum_c |\sum_k Cur_{kc} - \sum_k Ref_{kc}| \f$ exceeds the best cost, the reference
+ *  column sums sliding one line per vertical step. Survivors are scored 4 at a time with
+ *  partial distortion elimination. Rejected candidates are counted in sea_rejected.
+ *
+ * @param me_ctx     Motion estimation context with me_ctx->method = 'BLOCK_MATCHING_ES'
+ *
+ * @return           big if true 
+ */
+bool motionEstES(MotionEstContext *);
+
+/** 
+ * @brief Allocate the half pixel planes and mvq_table, called by init_context when ctx->subpel is set
+ * @return big if true
+ */
+bool me_subpel_alloc(MotionEstContext *ctx);
+
+/**
+ * @brief Refine mv_table[0] to 1/2 or 1/4 pixel into mvq_table, called by motion_estimation
+ *
+ *  The half pixel planes of the reference are interpolated once per frame (bilinear or 6-tap),
+ *  then for each block the 8 half pixel neighbours of the integer vector are checked, and
+ *  with SUBPEL_QUARTER the 8 quarter pixel neighbours of the best one (averaged from the
+ *  half pixel planes when scored). mv_table[0] and ctx->max are left untouched.
+ * @return big if true
+ */
+bool me_subpel_refine(MotionEstContext *ctx);
+
+/**
+ * @brief Allocate mv_table[0] and the FFT buffers of PHASE_CORRELATION, called by init_context
+ *
+ *  mbSize = 0 : global shift only (b_count = 1), else mbSize is rounded to a power of 2
+ *  and a shift is computed for every mbSize x mbSize tile.
+ * @return big if true
+ */
+bool me_pc_alloc(MotionEstContext *ctx);
+
+/**
+ * @brief Phase correlation : dominant translation between the two frames
+ *
+ *  Cur and ref are windowed (Hann) and transformed together by a single complex 2D FFT
+ *  (cur real part, ref imaginary part), the normalised cross power spectrum is transformed
+ *  back and its peak, refined by a parabola fit, gives the shift. The global shift uses
+ *  the largest centred power of 2 window (PC_SIZE_MAX at most) and is saved in
+ *  pc_dx / pc_dy / pc_peak, rounded in mv_table[0][0] when mbSize = 0. With mbSize set,
+ *  mv_table[0] receives the shift of each tile (range \f$ \pm mbSize / 2 \f$).
+ *
+ * @param me_ctx     Motion estimation context with me_ctx->method = 'PHASE_CORRELATION'
+ *
+ * @return           big if true 
+ */
+bool motionEstPhaseCorrelation(MotionEstContext *);
+
+/**
+ * @brief Hierarchical EPZS
+ *
+ *  Frames are decimated by 2 (2x2 average) pyr_levels - 1 times. EPZS runs on the coarsest
+ *  level first, then each finer level uses the vectors of the previous one (scaled by 2)
+ *  as an extra predictor with a search window twice as large. The effective search range
+ *  at full resolution is then `search_param << (pyr_levels - 1)` for roughly the cost of
+ *  one EPZS pass. Vectors are saved in mv_table[0] like EPZS.
+ *  Levels narrower than 4 blocks or shorter than 1 block are dropped. With ctx->sea every
+ *  level uses SEA, cost_count, cost_aborted and sea_rejected add up all the levels.
+ *
+ * @param me_ctx     Motion estimation context with me_ctx->method = 'BLOCK_MATCHING_PYRAMID'
+ *
+ * @return           big if true 
+ */
+bool motionEstPyramid(MotionEstContext *);
+
 /** @} */
 
 /** 
- * @brief Compute motion compensated image's PSNR  \n
- *  \f[ \text{PSNR} = 10 \log_{10}\frac {(\text{peak to peak value of original data})^2}{\text{MSE}}  \f]
- * @param imgP      : original image of size w * h
- * @param imgComp   : compensated image of size w * h
+ * @brief Motion compensated image : every block is copied from the reference at its vector
+ *
+ *  Vectors follow the block matching convention (the block at (x, y) matches the reference
+ *  at (x + vx, y + vy)), source blocks are clamped to the frame. Pixels out of the block grid are 0.
+ * @param imgI      : reference image of size w * h
+ * @param motionVect : one vector per block (row major), mv_table[0] of a block matching context
+ * @param imgComp   : output compensated image of size w * h (allocated by the caller)
  * @param w         : width of image
  * @param h         : height of image
- * @param n         : the peak value of possible of any pixel in the img
+ * @param mbSize    : macro block size
  * 
- * @return motion compensated image's psnr  
+ * @return big if true
  */
-uint8_t *motionComp(const uint8_t *imgI, const MotionVector16_t *motionVect, size_t w, size_t h, 
+bool motionCompBuf(const uint8_t *imgI, const MotionVector16_t *motionVect, uint8_t *imgComp, size_t w, size_t h,
 		size_t mbSize);
 
+/** 
+ * @brief Motion compensated image allocated with malloc (freed by the caller), see motionCompBuf
+ * @return the compensated image of size w * h, NULL on failure
+ */
+uint8_t *motionComp(const uint8_t *imgI, const MotionVector16_t *motionVect, size_t w, size_t h, size_t mbSize);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,78 @@
+/** @file multi_stream.h
+*   @brief Independent motion estimation streams (one per camera) run in parallel
+*
+*   Each stream owns its MotionEstContext and deflicker queue. A batch holds frames of any of the
+*   streams, the frames of a stream are estimated in batch order, the streams are spread over the
+*   workers of a pool (work stealing, see parallel.h) : one frame per stream and per batch keeps
+*   all the workers busy as long as there are more streams than threads.
+*/
+
+#ifndef MULTI_STREAM_H
+#define MULTI_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "motion.h"
+#include "deflicker.h"
+
+/** @brief one camera stream */
+typedef struct {
+	MotionEstContext ctx;				///< settings set before me_streams_init (ctx.threads is ignored : the streams run in parallel)
+	bool deflicker;						///< deflicker the current frame (in place) before its estimation
+	queue_t deflicker_queue;			///< brightness queue of the stream
+	int frames;							///< frames estimated
+} MotionEstStream;
+
+/** @brief frame of a batch */
+typedef struct {
+	int stream;							///< index of the stream
+	uint8_t *img_prev,					///< previous frame of the stream
+	        *img_cur;					///< current frame of the stream
+	bool ok;							///< result of motion_estimation, set by me_streams_run
+} MotionEstFrame;
+
+/**
+ * @brief called by the worker which estimated f, ctx->mv_table[0] holds its vectors
+ *  (only until the next frame of the stream)
+ */
+typedef void (*me_frame_done_func)(void *user, const MotionEstFrame *f, const MotionEstContext *ctx);
+
+/** @brief streams and the workers running them */
+typedef struct {
+	MotionEstStream *streams;			///< count streams, owned by the caller
+	int count;
+	int threads;						///< workers over the streams, caller included (set before me_streams_init)
+	MEPool *pool;						///< started by me_streams_init when threads > 1
+	me_frame_done_func done;			///< optional, called after each frame
+	void *user;							///< argument of done
+
+	/* current batch */
+	MotionEstFrame *batch;
+	int batch_size;
+} MotionEstStreams;
+
+/**
+ * @brief init_context of each stream and start the workers
+ * @param streams   count streams with their ctx settings
+ * @return big if true (uninit with me_streams_uninit anyway)
+ */
+bool me_streams_init(MotionEstStreams *ms, MotionEstStream *streams, int count);
+
+/** @brief uninit the streams and stop the workers */
+void me_streams_uninit(MotionEstStreams *ms);
+
+/**
+ * @brief estimate the n frames of batch, returns when all are done
+ *
+ *  The frames of a stream are estimated in batch order by one worker, the vectors left in
+ *  its ctx.mv_table[0] are the ones of its last frame (use done for the others).
+ * @return true if all the frames were estimated
+ */
+bool me_streams_run(MotionEstStreams *ms, MotionEstFrame *batch, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+/** @file parallel.h
+*   @brief Bands of rows (or blocks) run in parallel, by threads started for the call or by a persistent pool
+*
+*   pthreads on Linux, the ESP-IDF pthread component (FreeRTOS tasks spread over both cores) on ESP32.
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <stdbool.h>
+#include <pthread.h>
+
+/** max threads of a parallel call, caller included */
+#define ME_THREADS_MAX 8
+
+/** stack of the worker threads on ESP32 (bytes) */
+#define ME_THREAD_STACK 4096
+
+/**
+ * @brief work of one band (or tile)
+ * @param band   index of the band in [0, bands), of the worker with me_parallel_tiles
+ *               (a worker runs several tiles : per worker scratch and results are indexed by it)
+ * @param begin,end  items [begin, end) of the band
+ */
+typedef void (*me_band_func)(void *arg, int band, int begin, int end);
+
+/**
+ * @brief pthread_create, on ESP32 with a stack of stack bytes, pinned core cores after the caller's one (0 : same core)
+ * @return big if true
+ */
+bool me_thread_create(pthread_t *tid, void *(*func)(void *), void *arg, int core, int stack);
+
+/** @brief threads clamped to [1, ME_THREADS_MAX] (0 : 1) */
+int me_threads(int threads);
+
+/** @brief number of bands me_parallel_bands splits n items in */
+int me_parallel_count(int threads, int n);
+
+/**
+ * @brief split [0, n) in contiguous bands run in parallel, band 0 by the caller
+ *
+ *  Returns once all the bands are done. A band whose thread can't be created is run by the caller.
+ * @return number of bands
+ */
+int me_parallel_bands(int threads, int n, me_band_func func, void *arg);
+
+/** persistent worker threads, see me_pool_create */
+typedef struct MEPool MEPool;
+
+/**
+ * @brief start threads - 1 persistent workers, the caller of me_parallel_tiles is worker 0
+ * @return NULL if threads <= 1 or if no worker could be started
+ */
+MEPool *me_pool_create(int threads);
+
+/** @brief stop and join the workers (NULL is a no-op) */
+void me_pool_destroy(MEPool *pool);
+
+/** @brief workers of the pool, caller included (1 if NULL) */
+int me_pool_threads(const MEPool *pool);
+
+/**
+ * @brief split [0, n) in tiles of tile items run by the workers of the pool, with work stealing
+ *
+ *  Each worker starts with a contiguous share of the tiles, takes them in order, then steals the
+ *  last tile of the others. Returns once all the tiles are done. Not reentrant : one call at a time per pool.
+ * @param pool   NULL : func runs [0, n) on the caller
+ * @param tile   items per tile (<= 0 : one share per worker)
+ * @return number of workers used, the band argument of func is in [0, workers)
+ */
+int me_parallel_tiles(MEPool *pool, int n, int tile, me_band_func func, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
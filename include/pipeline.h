@@ -0,0 +1,106 @@
+/** @file pipeline.h
+*   @brief Pipelined motion estimation of one stream : pre-processing of frame t+1 while frame t is estimated
+*
+*   capture (caller) -> pre-processing thread (deflicker, pre) -> estimation thread (motion_estimation)
+*   -> post-processing (caller). The stages exchange frame records through bounded lock-free
+*   single producer / single consumer queues, a stage only sleeps when its input queue is empty.
+*   Throughput is the one of the slowest stage instead of the sum of the stages. On ESP32 the
+*   estimation thread is pinned to the core after the caller's one, the pre-processing thread to
+*   the caller's core.
+*
+*   me_pipeline_push is called by one thread (capture), me_pipeline_pop and me_pipeline_release by
+*   one thread (post-processing), both may be the same.
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "motion.h"
+#include "deflicker.h"
+
+/** @brief max frames in flight */
+#define ME_PIPE_DEPTH_MAX 8
+
+/** @brief frames in flight when depth is 0 */
+#define ME_PIPE_DEPTH 3
+
+/** @brief optional pre-processing of a frame (in place), run by the pre-processing thread after deflicker */
+typedef void (*me_pipe_pre_func)(void *user, uint8_t *img, int w, int h);
+
+/** @brief frame record, owned by the pipeline */
+typedef struct {
+	uint8_t *img;						///< frame given to me_pipeline_push, pre-processed in place
+	void *user;							///< given to me_pipeline_push (timestamp, ...)
+	uint8_t *img_released;				///< frame pushed before img, not used by the pipeline any more (NULL for the first)
+	bool ok;							///< result of motion_estimation (false for the first frame : no reference)
+	int max;							///< ctx.max of the estimation
+	MotionVector16_t *mv;				///< copy of ctx.mv_table[0] (b_count vectors)
+	bool end;							///< end marker pushed by me_pipeline_close
+} MEPipeFrame;
+
+/** @brief bounded lock-free single producer / single consumer queue of frame records (pipeline.c) */
+typedef struct MEPipeQueue MEPipeQueue;
+
+/** @brief pipeline of one stream */
+typedef struct {
+	MotionEstContext ctx;				///< settings set before me_pipeline_init (ctx.threads : workers of the estimation stage)
+	bool deflicker;						///< deflicker the frames before their estimation
+	me_pipe_pre_func pre;				///< optional
+	void *pre_user;						///< argument of pre
+	int depth;							///< frames in flight, at most ME_PIPE_DEPTH_MAX (0 : ME_PIPE_DEPTH)
+
+	/* internal */
+	queue_t deflicker_queue;
+	MEPipeFrame frame[ME_PIPE_DEPTH_MAX];
+	MEPipeFrame end;					///< end marker
+	MotionVector16_t *mv;				///< vectors of the records
+	MEPipeQueue *queue;					///< released records, pre-processing, estimation and output queues
+	uint8_t *prev;						///< last frame estimated, reference of the next one
+	pthread_t tid[2];					///< pre-processing, estimation
+	bool threaded;						///< stage threads running, else me_pipeline_push runs the stages
+	bool closed;						///< me_pipeline_close called
+	bool ended;							///< end marker popped
+} MEPipeline;
+
+/**
+ * @brief init_context and start the stage threads (if they can't be started, me_pipeline_push runs the stages)
+ * @return big if true (uninit with me_pipeline_uninit anyway)
+ */
+bool me_pipeline_init(MEPipeline *p);
+
+/**
+ * @brief push the next frame of the stream
+ *
+ *  img must not be changed or freed until it comes back as img_released of a later frame
+ *  (or the pipeline ended).
+ * @param wait  block while depth frames are in flight (pushed but not released) : from the thread
+ *  which pops, don't wait but pop when it fails
+ * @return false if not pushed (no free record and !wait, or closed)
+ */
+bool me_pipeline_push(MEPipeline *p, uint8_t *img, void *user, bool wait);
+
+/**
+ * @brief next estimated frame, in push order
+ * @param wait  block until a frame is estimated
+ * @return the frame to give back with me_pipeline_release, NULL if none (!wait) or ended :
+ *  all the frames pushed before me_pipeline_close were popped, their images are all free.
+ */
+MEPipeFrame *me_pipeline_pop(MEPipeline *p, bool wait);
+
+/** @brief give back a popped frame record */
+void me_pipeline_release(MEPipeline *p, MEPipeFrame *f);
+
+/** @brief no more frames (called by the capture thread) : me_pipeline_pop returns NULL once the frames in flight are popped */
+void me_pipeline_close(MEPipeline *p);
+
+/** @brief close, drop the frames in flight, stop the threads and uninit the context (once capture and post-processing stopped) */
+void me_pipeline_uninit(MEPipeline *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
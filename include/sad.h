@@ -0,0 +1,119 @@
+/** @file sad.h
+*   @brief Sum of Absolute Difference kernels used as block matching cost
+*   @author Thomas Pegot
+*/
+
+#ifndef SAD_H
+#define SAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/**
+ * @brief SAD kernel prototype
+ *
+ * \f[ SAD = \sum_{i=0}^{mbSize}\sum_{j=0}^{mbSize} |Cur_{ij}-Ref_{ij}| \f]
+ *
+ * @param cur      top-left pixel of the current block
+ * @param ref      top-left pixel of the reference block
+ * @param linesize stride (in bytes) of both images
+ * @param mbSize   side of the square blocks
+ * @return the SAD of the two blocks
+ */
+typedef uint32_t (*me_sad_func)(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize);
+
+/**
+ * @brief Flag set on the result of a bounded kernel stopped before the last line.
+ *
+ *  The partial sum is kept in the low bits, the result is then greater than any complete SAD
+ *  so it can still be compared to the best cost.
+ */
+#define ME_SAD_ABORTED 0x80000000u
+
+/**
+ * @brief Bounded SAD kernel prototype (partial distortion elimination)
+ *
+ *  Same as me_sad_func but the partial sum is checked line by line (every 4 lines for SIMD),
+ *  once it reaches `limit` the block can't be better than the current best and the kernel returns.
+ *
+ * @param limit    current best cost
+ * @return the SAD, or the partial sum | ME_SAD_ABORTED if >= limit before the last line
+ */
+typedef uint32_t (*me_sad_bounded_func)(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize,
+                                        uint32_t limit);
+
+/**
+ * @brief SAD of one current block against 4 reference blocks
+ *
+ *  The current block is read once for the 4 candidates (diamond / rood patterns).
+ *  The scan stops once the 4 partial sums reached `limit` (all sad flagged ME_SAD_ABORTED).
+ *
+ * @param cur      top-left pixel of the current block
+ * @param ref      top-left pixel of the 4 reference blocks
+ * @param linesize stride (in bytes) of both images
+ * @param mbSize   side of the square blocks
+ * @param limit    current best cost (UINT32_MAX to get the 4 full SAD)
+ * @param[out] sad SAD of each candidate
+ */
+typedef void (*me_sad_x4_func)(const uint8_t *cur, const uint8_t *const ref[4], int linesize, int mbSize,
+                               uint32_t limit, uint32_t sad[4]);
+
+/** @brief portable C kernel, works for any block size */
+uint32_t me_sad_c(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize);
+
+/**
+ * @name Fixed size C kernels
+ *  Same as me_sad_c with a compile-time block size (fully unrolled loops), mbSize is ignored.
+ * @{
+ */
+uint32_t me_sad_c_4 (const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize);
+uint32_t me_sad_c_8 (const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize);
+uint32_t me_sad_c_16(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize);
+uint32_t me_sad_c_32(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize);
+/** @} */
+
+/** @brief portable C bounded kernel, works for any block size */
+uint32_t me_sad_bounded_c(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize, uint32_t limit);
+
+/** @brief portable C x4 kernel, works for any block size */
+void me_sad_x4_c(const uint8_t *cur, const uint8_t *const ref[4], int linesize, int mbSize,
+                 uint32_t limit, uint32_t sad[4]);
+
+/**
+ * @brief Select the fastest SAD kernel available for this cpu and block size.
+ *
+ *  Called once by init_context, the result is saved in MotionEstContext::sad.
+ *  - x86 : AVX2 (checked at runtime), then SSE2 `psadbw`
+ *  - ESP32-S3 : me_sad_select_pie() hook
+ *  - otherwise : me_sad_c_4 .. me_sad_c_32 or me_sad_c for other sizes
+ *
+ *  SIMD kernels are also specialized for 4, 8, 16 and 32.
+ *
+ * @param mbSize macro block size
+ * @return SAD kernel
+ */
+me_sad_func me_sad_select(int mbSize);
+
+/** @brief Same as me_sad_select for the x4 kernels (no PIE hook) */
+me_sad_x4_func me_sad_x4_select(int mbSize);
+
+/** @brief Same as me_sad_select for the bounded kernels (no PIE hook) */
+me_sad_bounded_func me_sad_bounded_select(int mbSize);
+
+/**
+ * @brief ESP32-S3 PIE hook
+ *
+ *  Weak symbol returning NULL, an application providing a PIE (vector extension)
+ *  implementation can override it and return its own kernel for `mbSize`.
+ *  Returning NULL fallback to me_sad_c.
+ */
+me_sad_func me_sad_select_pie(int mbSize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
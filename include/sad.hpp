@@ -0,0 +1,47 @@
+/** @file sad.hpp
+*   @brief C++ access to the fixed size SAD kernels of sad.h
+*
+*   @code{cpp}
+*   uint32_t cost = motion::sad<16>(cur, ref, width);          // C kernel, constant trip counts
+*   me_sad_func best = motion::Sad<16>::select();              // fastest kernel for 16x16
+*   @endcode
+*   @author Thomas Pegot
+*/
+
+#ifndef SAD_HPP
+#define SAD_HPP
+
+#include "sad.h"
+
+namespace motion {
+
+/** @brief fixed size SAD kernels, only defined for N = 4, 8, 16, 32 */
+template <int N> struct Sad;
+
+#define ME_SAD_SPECIALIZE(n)                                                        \
+template <> struct Sad<n> {                                                         \
+    static constexpr int size = n;                                                  \
+    /** @brief unrolled C kernel */                                                 \
+    static uint32_t c(const uint8_t *cur, const uint8_t *ref, int linesize) {       \
+        return me_sad_c_##n(cur, ref, linesize, n);                                 \
+    }                                                                               \
+    /** @brief fastest kernel for this cpu (see me_sad_select) */                   \
+    static me_sad_func select() { return me_sad_select(n); }                        \
+};
+
+ME_SAD_SPECIALIZE(4)
+ME_SAD_SPECIALIZE(8)
+ME_SAD_SPECIALIZE(16)
+ME_SAD_SPECIALIZE(32)
+
+#undef ME_SAD_SPECIALIZE
+
+/** @brief SAD of two NxN blocks with the unrolled C kernel */
+template <int N>
+inline uint32_t sad(const uint8_t *cur, const uint8_t *ref, int linesize) {
+    return Sad<N>::c(cur, ref, linesize);
+}
+
+} // namespace motion
+
+#endif
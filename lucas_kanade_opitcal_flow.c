@@ -25,21 +25,11 @@ static const char *TAG = "LK_OPTICAL_FLOW";
 #define NOSMOOTH 1
 
 static const float NoiseThreshold = 0.01; /* Lucas Kanade noise threshold */
-static const int half_window = WINDOW << 1;
-static const int window_squared = WINDOW * WINDOW;
-static const int log2_window = (int const)ceil(log2(WINDOW));
-
-/** define 5x5 Gaussian kernel flattened */
-static const float kernel[WINDOW * WINDOW] = {1 / 256.0f, 4 / 256.0f, 6 / 256.0f, 4 / 256.0f, 1 / 256.0f, 4 / 256.0f, 16 / 256.0f,
-	24 / 256.0f, 16 / 256.0f, 4 / 256.0f, 6 / 256.0f, 24 / 256.0f, 36 / 256.0f, 24 / 256.0f, 6 / 256.0f, 4 / 256.0f,
-	16 / 256.0f, 24 / 256.0f, 16 / 256.0f, 4 / 256.0f, 1 / 256.0f, 4 / 256.0f, 6 / 256.0f, 4 / 256.0f, 1 / 256.0f};
+static const int half_window = WINDOW >> 1;
 
 /** Separable Gaussian kernel */
 static const float Kernel_isotropic[WINDOW] = {1.0 / 16.0, 4.0 / 16.0, 6.0 / 16.0, 4.0 / 16.0, 1.0 / 16.0 };
 
-/* Differentiate Lucas Kanade kernel https://www.cs.toronto.edu/~fleet/research/Papers/ijcv-94.pdf */
-static const float Kernel_Dxy[WINDOW] = {-1.0 / 12.0, 8.0 / 12, 0, -8.0 / 12.0, 1.0 / 12.0};
-
 static void *_malloc(size_t size) {
     void *res = malloc(size);
     if(res)
@@ -47,234 +37,588 @@ static void *_malloc(size_t size) {
     return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 }
 
-bool LK_optical_flow(MotionEstContext *ctx) {
-	const int w = ctx->width;
-	const int h = ctx->height;
-	const int N = w * h;
-	float *image1 = (float*)_malloc(N * sizeof(float));   // temp image
-#if !NOSMOOTH
-	float *image2 = (float*)_malloc(N * sizeof(float)); // temp image
-	if(!image2) {
-		ESP_LOGE(TAG, "allocation failed!");
-		return false;
+/** number of products in the structure tensor : Ix², IxIy, Iy², IxIt, IyIt */
+#define LK_PRODUCTS 5
+
+/** floats of the lk_flow scratch : ring of tensor rows, vx, vy, then 3 gradient rows and the int16 halo rows when streaming */
+#define LK_RING_SIZE(w, stream) ((size_t)(WINDOW * LK_PRODUCTS + 2 + ((stream) ? 4 : 0)) * (w))
+
+/** floats of the lk_smooth_gradients scratch : 5 frames and the convolution rings of the threads */
+#define LK_SMOOTH_SIZE(w, h, threads) (5 * (size_t)(w) * (h) + convExecWorkSize(w, 5, threads) / sizeof(float))
+
+/**
+ * @brief pixels where the flow is solved : (first + n * step, first + m * step) below (end_x, end_y)
+ *
+ *  step 1 is the dense flow. The window centres are the middle of the step x step cells of the
+ *  output table (b_width x b_height), cells whose window crosses the frame border are left to 0.
+ */
+typedef struct {
+	int step, first, end_x, end_y;
+	int span_x0, span_w, span_n;	///< columns of gradients needed : span_n spans of span_w, step apart
+} LKGrid;
+
+static void lk_grid(LKGrid *g, int w, int h, int step) {
+	g->step = step;
+	for(g->first = step >> 1; g->first < half_window; g->first += step);
+	g->end_x = mmin(w - half_window, (w / step) * step);
+	g->end_y = mmin(h - half_window, (h / step) * step);
+	if(step < WINDOW) {
+		// windows overlap : every column
+		g->span_x0 = 0;
+		g->span_w = w;
+		g->span_n = 1;
+	} else {
+		g->span_x0 = g->first - half_window;
+		g->span_w = WINDOW;
+		g->span_n = g->end_x > g->first ? (g->end_x - g->first + step - 1) / step : 0;
 	}
-#endif
-	float *fx = (float*)_malloc(N * sizeof(float)),
-		*ft = (float*)_malloc(N * sizeof(float)),
-		*fy = (float*)_malloc(N * sizeof(float));
-	int i, j, m;
-	ctx->max = 0;
+}
 
-	if(!fx || !fy || !ft || !image1) {
-		ESP_LOGE(TAG, "allocation failed!");
-		return false;
+/** @brief row i of the gradients is in the window of a solved row */
+static inline bool lk_row_needed(const LKGrid *g, int i) {
+	const int k = i + half_window - g->first;
+	return g->step < WINDOW || (k >= 0 && k % g->step < WINDOW);
+}
+
+/** @brief row c is solved */
+static inline bool lk_row_solved(const LKGrid *g, int c) {
+	return c >= g->first && c < g->end_y && (c - g->first) % g->step == 0;
+}
+
+/**
+ * @brief Horizontal pass of the structure tensor for one row
+ *
+ *  The window weights of each gradient are the 5x5 Gaussian (Kernel_isotropic x Kernel_isotropic),
+ *  so each product is weighted by its square, which is separable too : Kernel_isotropic[k]².
+ *  t[p * w + j] receives product p filtered around column j, for the columns j of the grid.
+ */
+static void tensor_row(const float *fx, const float *fy, const float *ft, int w, const LKGrid *g, float *t) {
+	float W2[WINDOW];
+	int j, k;
+
+	for(k = 0; k < WINDOW; k++)
+		W2[k] = Kernel_isotropic[k] * Kernel_isotropic[k];
+
+	for(j = g->first; j < g->end_x; j += g->step) {
+		float s[LK_PRODUCTS] = {0};
+		for(k = 0; k < WINDOW; k++) {
+			const int index = j + k - half_window;
+			const float Ix = fx[index], Iy = fy[index], It = ft[index];
+			s[0] += W2[k] * Ix * Ix;
+			s[1] += W2[k] * Ix * Iy;
+			s[2] += W2[k] * Iy * Iy;
+			s[3] += W2[k] * Ix * It;
+			s[4] += W2[k] * Iy * It;
+		}
+		for(k = 0; k < LK_PRODUCTS; k++)
+			t[k * w + j] = s[k];
 	}
+}
 
-	/* init input */
-	for(i = N; i--; ) {
-		const float tmp_fX = ctx->data_ref[i];
-		fx[i] = tmp_fX;
-		ft[i] = ctx->data_cur[i] - tmp_fX;  /* Gradient computation: I_{t+1} - I_{t} */
-		fy[i] = tmp_fX;   					/* fy initialisation as smoothed input = fx */
+/**
+ * @brief Vertical pass of the structure tensor and 2x2 solve for one row
+ *
+ * @param rows   horizontal passes (tensor_row) of the WINDOW rows centred on the solved row
+ * @param vx,vy  flow of the row, 0 where the smallest eigenvalue is below NoiseThreshold
+ */
+static void lk_solve_row(float *const rows[WINDOW], int w, const LKGrid *g, float *vx, float *vy) {
+	float W2[WINDOW];
+	int j, k;
+
+	for(k = 0; k < WINDOW; k++)
+		W2[k] = Kernel_isotropic[k] * Kernel_isotropic[k];
+
+	for(j = g->first; j < g->end_x; j += g->step) {
+		float a = 0, b = 0, c = 0, Atb0 = 0, Atb1 = 0;
+		for(k = 0; k < WINDOW; k++) {
+			const float *t = rows[k] + j;
+			a    += W2[k] * t[0];
+			b    += W2[k] * t[w];
+			c    += W2[k] * t[2 * w];
+			Atb0 -= W2[k] * t[3 * w];
+			Atb1 -= W2[k] * t[4 * w];
+		}
 
-		ctx->mv_table[0][i].vx = 0;
-		ctx->mv_table[0][i].vy = 0;
-		ctx->mv_table[0][i].mag2 = 0;
+		//const float eigenval1 = ((a + c) + sqrtf(4 * b * b + powf(a - c, 2))) /2;
+		//const float eigenval2 = ((a + c) - hypotf(2 * b, a - c)) * 0.5;
+		if(((a + c) - hypotf(2 * b, a - c)) * 0.5 >= NoiseThreshold) {
+			//Case 1: λ1≥λ2≥τ equivalent to λ2≥τ
+			//A is nonsingular, the system of equations are solved using Cramer's rule.
+			const float det = a * c - b * b;
+			//optical flow : [Vx Vy] = inv[AtA] . Atb
+			vx[j] = (c * Atb0 - b * Atb1) / det;
+			vy[j] = (a * Atb1 - b * Atb0) / det;
+		} else
+			vx[j] = vy[j] = 0;
 	}
+}
 
-#if NOSMOOTH
-	/* Derivate Dx : 1D convolution horizontal */
-	if(!convH(fx, image1, w, h, Kernel_Dxy, 5)) {
-		ESP_LOGE(TAG, "convH failed!");
-		return false;
+/**
+ * @brief gradients of row i, columns [j0, j1), as convH / convV with Kernel_Dxy would compute them
+ *  (same sums, zero padding)
+ */
+static void gradient_row(const uint8_t *ref, const uint8_t *cur, int w, int h, int i, int j0, int j1,
+		float *fx, float *fy, float *ft) {
+	int j, m;
+
+	for(j = j0; j < j1; j++) {
+		float sx = 0, sy = 0;
+		for(m = 0; m < WINDOW; m++) {
+			const int x = j - half_window + m, y = i - half_window + m;
+			if(x >= 0 && x < w)
+				sx += ref[i * w + x] * Kernel_Dxy[WINDOW - 1 - m];
+			if(y >= 0 && y < h)
+				sy += ref[y * w + j] * Kernel_Dxy[WINDOW - 1 - m];
+		}
+		fx[j] = sx;
+		fy[j] = sy;
+		ft[j] = cur[i * w + j] - (float)ref[i * w + j];  /* I_{t+1} - I_{t} */
 	}
-	memcpy(fx, image1, N * sizeof(float));
+}
 
-	/* Derivate Dy : 1D convolution vertical */
-	if(!convV(fy, image1, w, h, Kernel_Dxy, 5)) {
-		ESP_LOGE(TAG, "convV failed!");
-		return false;
+/** @brief 12 * derivative of p along step at index i (zero outside [0, n)) */
+static inline int16_t deriv12(const uint8_t *p, int step, int i, int n) {
+#define AT(k) ((i + (k)) >= 0 && (i + (k)) < n ? p[(i + (k)) * step] : 0)
+	return AT(-2) - 8 * AT(-1) + 8 * AT(1) - AT(2);
+#undef AT
+}
+
+/** @brief 12 * Ix, 12 * Iy of row i, columns [j0, j1) of img (exact in int16) */
+static void grad12_row(const uint8_t *img, int w, int h, int i, int j0, int j1, int16_t *gx, int16_t *gy) {
+	int j;
+
+	for(j = j0; j < j1; j++) {
+		gx[j] = deriv12(img + i * w, 1, j, w);
+		gy[j] = deriv12(img + j, w, i, h);
 	}
-	memcpy(fy, image1, N * sizeof(float));
-#else
+}
+
+/** @brief where lk_flow reads its gradients */
+typedef struct {
+	const uint8_t *ref, *cur;		///< frames, gradients computed row by row
+	const float *fx, *fy, *ft;		///< or full frame gradients (fx != NULL)
+	int16_t *grad;					///< lk_reuse : 12 Ix, 12 Iy planes of ref if grad_valid, replaced by the cur ones
+	bool grad_valid;
+	int w, h;
+} LKSource;
+
+/**
+ * @brief lk_reuse gradients of row i : mean of the ref (kept from the previous call) and cur ones
+ *
+ *  gx, gy : row i of the s->grad planes, the cur gradients overwrite the ref ones once read, so only
+ *  the new frame is differentiated when the reference is the previous current frame.
+ *  (or a scratch with valid false : both frames differentiated, s->grad untouched)
+ */
+static void gradient_row_reuse(const LKSource *s, int i, int16_t *gx, int16_t *gy, bool valid,
+		float *fx, float *fy, float *ft) {
+	const int w = s->w;
+	int j;
+
+	if(!valid)
+		grad12_row(s->ref, w, s->h, i, 0, w, gx, gy);
+	for(j = 0; j < w; j++) {
+		fx[j] = gx[j];
+		fy[j] = gy[j];
+	}
+	grad12_row(s->cur, w, s->h, i, 0, w, gx, gy);
+	for(j = 0; j < w; j++) {
+		fx[j] = (fx[j] + gx[j]) * (1.0f / 24);
+		fy[j] = (fy[j] + gy[j]) * (1.0f / 24);
+		ft[j] = s->cur[i * w + j] - (float)s->ref[i * w + j];
+	}
+}
+
+/**
+ * @brief Lucas Kanade on the gradients : the products are computed once per pixel and summed
+ *  by a separable sliding window (WINDOW rows ring), instead of WINDOW² taps per pixel.
+ *
+ *  If src->fx is NULL the gradients are computed row by row from ref and cur : only
+ *  O(width) scratch is used and rows are emitted as soon as their window is complete.
+ *  On a sparse grid only the rows and columns inside the windows of the solved pixels are computed.
+ *  emit(arg, g, i, vx, vy) is called for every solved row i in [c0, c1), vx and vy being valid on the grid columns.
+ *  Rows [c0, c1) can be done by concurrent bands : the gradient rows of a band outside them (halo)
+ *  are computed again, and with lk_reuse only the band's own rows of src->grad are read and written.
+ *  buf : LK_RING_SIZE(w, src->fx == NULL) floats
+ */
+static void lk_flow(const LKSource *src, const LKGrid *g,
+		void (*emit)(void *arg, const LKGrid *g, int i, const float *vx, const float *vy), void *arg, float *buf,
+		int c0, int c1) {
+	const int w = src->w, h = src->h;
+	float *rows[WINDOW];
+	float *vx, *vy;
+	int i, k, n;
+
+	memset(buf, 0, LK_RING_SIZE(w, !src->fx) * sizeof(float));
+	vx = buf + WINDOW * LK_PRODUCTS * w;
+	vy = vx + w;
+
+	for(i = mmax(c0 - half_window, 0); i < mmin(c1 + half_window, h); i++) {
+		float *t = buf + (i % WINDOW) * LK_PRODUCTS * w;
+		if(!lk_row_needed(g, i))
+			continue;
+		if(src->fx)
+			tensor_row(src->fx + i * w, src->fy + i * w, src->ft + i * w, w, g, t);
+		else {
+			float *gx = vy + w, *gy = gx + w, *gt = gy + w;
+			if(src->grad && i >= c0 && i < c1)
+				gradient_row_reuse(src, i, src->grad + i * w, src->grad + (h + i) * w, src->grad_valid, gx, gy, gt);
+			else if(src->grad) {
+				int16_t *halo = (int16_t*)(gt + w);
+				gradient_row_reuse(src, i, halo, halo + w, false, gx, gy, gt);
+			}
+			else
+				for(n = 0; n < g->span_n; n++) {
+					const int j0 = g->span_x0 + n * g->step;
+					gradient_row(src->ref, src->cur, w, h, i, j0, j0 + g->span_w, gx, gy, gt);
+				}
+			tensor_row(gx, gy, gt, w, g, t);
+		}
+		if(!lk_row_solved(g, i - half_window) || i - half_window < c0)
+			continue;
+		// ring ordered from row i - WINDOW + 1 to row i
+		for(k = 0; k < WINDOW; k++)
+			rows[k] = buf + ((i + 1 + k) % WINDOW) * LK_PRODUCTS * w;
+		lk_solve_row(rows, w, g, vx, vy);
+		emit(arg, g, i - half_window, vx, vy);
+	}
+}
+
+/**
+ * @brief full frame gradients smoothed by the 5x5 Gaussian (LK_optical_flow8 and NOSMOOTH 0)
+ *  work : fx, fy, ft then 2 full frame temporaries and the convolution scratch (LK_SMOOTH_SIZE floats)
+ *  The convolutions are split in bands of rows over the workers of pool (NULL : serial).
+ */
+static bool lk_smooth_gradients(const uint8_t *src1, const uint8_t *src2, int w, int h, float *work, MEPool *pool) {
+	const int N = w * h;
+	float *fx = work, *fy = fx + N, *ft = fy + N;
+	float *image1 = ft + N, *image2 = image1 + N;
+	const ConvExec exec = {.threads = me_pool_threads(pool), .work = image2 + N, .pool = pool};
+	int i;
+
+	/* init input */
+	for(i = N; i--; ) {
+		const float tmp_fX = src1[i];
+		fx[i] = tmp_fX;
+		ft[i] = src2[i] - tmp_fX;  /* Gradient computation: I_{t+1} - I_{t} */
+		fy[i] = tmp_fX;   		   /* fy initialisation as smoothed input = fx */
+	}
+
 	/* Derivate Dx : 1D convolution horizontal */
-	if(!convH(fx, image1, w, h, Kernel_Dxy, 5)) {
+	if(!convHExec(fx, image1, w, h, Kernel_Dxy, KERNEL_DXY_SIZE, &exec)) {
 		ESP_LOGE(TAG, "convH failed!");
 		return false;
 	}
-	
+
 	/* Derivate Dy : 1D convolution vertical */
-	if(!convV(fy, image2, w, h, Kernel_Dxy, 5)) {
+	if(!convVExec(fy, image2, w, h, Kernel_Dxy, KERNEL_DXY_SIZE, &exec)) {
 		ESP_LOGE(TAG, "convV failed!");
 		return false;
 	}
 
 	/* Isotropic smooth */
-	if(!convolve2DSeparable(image1, fx, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5)) {
+	if(!convolve2DSeparableExec(image1, fx, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5, &exec) ||
+	   !convolve2DSeparableExec(image2, fy, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5, &exec) ||
+	   !convolve2DSeparableExec(ft, image2, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5, &exec)) {
 		ESP_LOGE(TAG, "convolve2DSeparable failed!") ;
 		return false;
 	}
 
-	if(!convolve2DSeparable(image2, fy, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5)) {
-		ESP_LOGE(TAG, "convolve2DSeparable failed!") ;
-		return false;
+	memcpy(ft, image2, N * sizeof(float));
+	return true;
+}
+
+/** @brief output of a band of LK_optical_flow */
+typedef struct {
+	MotionEstContext *ctx;
+	int max;						///< max mag² of the band
+} LKVectors;
+
+/** @brief emit of LK_optical_flow : vectors in ctx->mv_table[0], one per cell of the grid */
+static void emit_vector16(void *arg, const LKGrid *g, int i, const float *vx, const float *vy) {
+	LKVectors *out = (LKVectors*)arg;
+	MotionVector16_t *mv = &out->ctx->mv_table[0][(i / g->step) * out->ctx->b_width];
+	int j;
+
+	for(j = g->first; j < g->end_x; j += g->step) {
+		MotionVector16_t *v = &mv[j / g->step];
+		v->vx = (int16_t)vx[j];
+		v->vy = (int16_t)vy[j];
+		v->mag2 = (uint16_t)(vx[j] * vx[j] + vy[j] * vy[j]);
+		if(out->max < v->mag2)
+			out->max = v->mag2;
+	}
+}
+
+/** @brief tiles of rows of LK_optical_flow, a ring and an output per worker */
+typedef struct {
+	const LKSource *src;
+	const LKGrid *g;
+	float *buf;						///< rings of LK_RING_SIZE floats, one per worker
+	LKVectors out[ME_THREADS_MAX];
+} LKBands;
+
+static void lk_band(void *arg, int band, int c0, int c1) {
+	LKBands *b = (LKBands*)arg;
+	lk_flow(b->src, b->g, &emit_vector16, &b->out[band], b->buf + band * LK_RING_SIZE(b->src->w, !b->src->fx), c0, c1);
+}
+
+/** @brief lk_flow of the solved rows split in tiles of ctx->tile_size rows over ctx->pool, vectors in ctx->mv_table[0] */
+static void lk_flow_bands(MotionEstContext *ctx, const LKSource *src, const LKGrid *g, float *buf) {
+	LKBands b = {.src = src, .g = g, .buf = buf};
+	int n, band;
+
+	for(band = 0; band < ME_THREADS_MAX; band++)
+		b.out[band].ctx = ctx;
+	n = me_parallel_tiles(ctx->pool, src->h, ctx->tile_size, &lk_band, &b);
+	for(band = 0; band < n; band++)
+		ctx->max = mmax(ctx->max, b.out[band].max);
+}
+
+/** @brief output of LK_optical_flow8 before the normalisation to [0..255] */
+typedef struct {
+	uint16_t *mag;
+	uint16_t max;
+	int w;
+} LKMag;
+
+/** @brief emit of LK_optical_flow8 : squared magnitudes */
+static void emit_mag(void *arg, const LKGrid *g, int i, const float *vx, const float *vy) {
+	LKMag *m = (LKMag*)arg;
+	uint16_t *pMag = m->mag + i * m->w;
+	int j;
+
+	for(j = g->first; j < g->end_x; j += g->step) {
+		pMag[j] = (uint16_t)(vx[j] * vx[j] + vy[j] * vy[j]);
+		if(pMag[j] > m->max)
+			m->max = pMag[j];
 	}
+}
 
-	if(!convolve2DSeparable(ft, image2, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5)) {
-		ESP_LOGE(TAG, "convolve2DSeparable failed!") ;
+bool LK_optical_flow(MotionEstContext *ctx) {
+	const int w = ctx->width;
+	const int h = ctx->height;
+	LKGrid g;
+
+	lk_grid(&g, w, h, mmax(ctx->lk_stride, 1));
+	ctx->max = 0;
+	memset(ctx->mv_table[0], 0, ctx->b_count * sizeof(*ctx->mv_table[0]));
+
+#if NOSMOOTH
+	/* gradients, tensor and solve fused in one pass over the rows, no full frame buffer */
+	const LKSource src = {.ref = ctx->data_ref, .cur = ctx->data_cur, .w = w, .h = h, .grad = ctx->lk_grad,
+						  .grad_valid = ctx->lk_grad_frame && ctx->lk_grad_frame == ctx->data_ref};
+
+	lk_flow_bands(ctx, &src, &g, (float*)ctx->workspace);
+	ctx->lk_grad_frame = ctx->data_cur;
+#else
+	const int N = w * h;
+	float *work = (float*)ctx->workspace;
+	const LKSource src = {.fx = work, .fy = work + N, .ft = work + 2 * N, .w = w, .h = h};
+
+	if(!lk_smooth_gradients(ctx->data_ref, ctx->data_cur, w, h, work, ctx->pool))
 		return false;
-	}
-	
-	memcpy(ft, image2, N * sizeof(float));
-#endif
 
 	// Lucas Kanade optical flow algorithm
-	for(i = half_window; i < h - half_window; ++i) {
-		for(j = half_window; j < w - half_window; ++j) {
-			float Atb0 = 0, Atb1 = 0; 
-			float a = 0, b = 0, c = 0;
-			for(m = 0; m < window_squared; ++m) {
-				// Sum over the window W²
-				const float W = kernel[m];
-				const int i_window = (m >> log2_window) - half_window;
-				const int j_window = (m % WINDOW) - half_window;
-                const unsigned index = (j + j_window) + (i + i_window) * w;
-				const float Ix = (float) fx[index] * W;
-				const float Iy = (float) fy[index] * W;
-				const float It = (float) ft[index] * W;
-				a += Ix * Ix;
-				c += Iy * Iy; 
-				b += Ix * Iy;
-				Atb0 += - Ix * It;
-				Atb1 += - Iy * It;
-			}
-			
-			//const float eigenval1 = ((a + c) + sqrtf(4 * b * b + powf(a - c, 2))) /2;
-			//const float eigenval2 = ((a + c) - hypotf(2 * b, a - c)) * 0.5;
-
-			if(((a + c) - hypotf(2 * b, a - c)) * 0.5 >= NoiseThreshold) {
-				//Case 1: λ1≥λ2≥τ equivalent to λ2≥τ
-				//A is nonsingular, the system of equations are solved using Cramer's rule.
-				const float det = a * c - b * b;
-				const float b_by_det = b / det;
-				const float iAtA[2][2] = {{  c / det, - b_by_det},
-										  {- b_by_det,   a / det}};
-				//optical flow : [Vx Vy] = inv[AtA] . Atb
-				const float vx = iAtA[0][0] * Atb0 + iAtA[0][1] * Atb1;
-				const float vy = iAtA[1][0] * Atb0 + iAtA[1][1] * Atb1;	
-				MotionVector16_t *mv = &ctx->mv_table[0][i * w + j];
-				mv->vx = (int16_t)vx;
-				mv->vy = (int16_t)vy;
-				mv->mag2 = (uint16_t)(vx * vx + vy * vy);	
-				if(ctx->max < mv->mag2)
-					ctx->max = mv->mag2;		
-			} 
-		}
-    }
-
-	free(fx); free(image1); free(ft); free(fy); 
-#if !NOSMOOTH
-	free(image2);
+	lk_flow_bands(ctx, &src, &g, work + LK_SMOOTH_SIZE(w, h, ctx->threads));
 #endif
 	return true;
 }
 
-bool LK_optical_flow8(const uint8_t *src1, const uint8_t *src2, uint8_t *out, int w, int h) {
-	const int N = w * h;
-	uint16_t *tmpMagArray = (uint16_t*)calloc(N, sizeof(uint16_t));
-	uint16_t *pMag = tmpMagArray;
-	uint16_t maxMag = 0;
-	float *image1 = (float*)_malloc(N * sizeof(float)),
-		*image2 = (float*)_malloc(N * sizeof(float)),
-		*fx = (float*)_malloc(N * sizeof(float)),
-		*ft = (float*)_malloc(N * sizeof(float)),
-		*fy = (float*)_malloc(N * sizeof(float));
-	int i, j, m;
-
-	if(!fx || !fy || !ft || !image1 || !image2 || !N || !src1 || !src2) 
-		return false;
+/**
+ * @name Fixed point Lucas Kanade
+ *  Gradients are 12 * Kernel_Dxy (exact in int16), It is scaled by 12 too so the flow is unchanged,
+ *  window weights are 256 * Kernel_isotropic[k]² = {1, 16, 36, 16, 1} per axis.
+ *  With lk_reuse the ref and cur gradients are summed (24 * Kernel_Dxy, still exact in int16, the
+ *  row sums still fit int32) and It is scaled by 24 : no rounding of the mean.
+ * @{
+ */
+static const int32_t W2_fixed[WINDOW] = {1, 16, 36, 16, 1};
 
-	// init input
-	for(i = N; i--; ) {
-		const float tmp_fX = src1[i];
-		fx[i] = tmp_fX;
-		ft[i] = src2[i] - tmp_fX;  /* Gradient computation: I_{t+1} - I_{t} */
-		fy[i] = tmp_fX;   /* fy initialisation as smoothed input = fx */
-	}	
+/** NoiseThreshold in fixed point units : 12² * 256² * 0.01 (x4 with the 24 * gradients of lk_reuse) */
+#define LK_TAU_FIXED 94372
 
-	// Derivate Dx : 1D convolution horizontal
-	if(!convH(fx, image1, w, h, Kernel_Dxy, 5)) {
-		return false;
+/** @brief horizontal pass of the structure tensor (int32, see tensor_row) */
+static void tensor_row_fixed(const int16_t *fx, const int16_t *fy, const int16_t *ft, int w, const LKGrid *g,
+		int32_t *t) {
+	int j, k;
+
+	for(j = g->first; j < g->end_x; j += g->step) {
+		int32_t s[LK_PRODUCTS] = {0};
+		for(k = 0; k < WINDOW; k++) {
+			const int index = j + k - half_window;
+			const int32_t Ix = fx[index], Iy = fy[index], It = ft[index];
+			s[0] += W2_fixed[k] * (Ix * Ix);
+			s[1] += W2_fixed[k] * (Ix * Iy);
+			s[2] += W2_fixed[k] * (Iy * Iy);
+			s[3] += W2_fixed[k] * (Ix * It);
+			s[4] += W2_fixed[k] * (Iy * It);
+		}
+		for(k = 0; k < LK_PRODUCTS; k++)
+			t[k * w + j] = s[k];
 	}
-	
-	// Derivate Dy : 1D convolution vertical
-	if(!convV(fy, image2, w, h, Kernel_Dxy, 5)) {
-		return false;
+}
+
+/**
+ * @brief vertical pass (int64) and integer 2x2 solve of one row
+ *
+ *  The sums are shifted right until they fit 28 bits so every product fits int64.
+ *  \f$ \lambda_2 \ge \tau \f$ is tested without square root as
+ *  \f$ (\lambda_1 - \tau)(\lambda_2 - \tau) = det - \tau T + \tau^2 \ge 0 \f$ and \f$ T \ge 2 \tau \f$.
+ */
+static void lk_solve_row_fixed(int32_t *const rows[WINDOW], int w, const LKGrid *g, int64_t tau_fixed,
+		MotionVector16_t *mv, int *max) {
+	int j, k;
+
+	for(j = g->first; j < g->end_x; j += g->step) {
+		MotionVector16_t *v = &mv[j / g->step];
+		int64_t a = 0, b = 0, c = 0, Atb0 = 0, Atb1 = 0;
+		for(k = 0; k < WINDOW; k++) {
+			const int32_t *t = rows[k] + j;
+			a    += W2_fixed[k] * (int64_t)t[0];
+			b    += W2_fixed[k] * (int64_t)t[w];
+			c    += W2_fixed[k] * (int64_t)t[2 * w];
+			Atb0 -= W2_fixed[k] * (int64_t)t[3 * w];
+			Atb1 -= W2_fixed[k] * (int64_t)t[4 * w];
+		}
+
+		uint64_t m = mmax(mmax(a, c), mmax(llabs(Atb0), llabs(Atb1)));
+		int shift = 0;
+		while((m >> shift) >= (1 << 28))
+			shift++;
+		a >>= shift; b >>= shift; c >>= shift; Atb0 >>= shift; Atb1 >>= shift;
+
+		const int64_t tau = tau_fixed >> shift;
+		const int64_t T = a + c;
+		const int64_t det = a * c - b * b;
+		if(T >= 2 * tau && det - tau * T + tau * tau >= 0 && det > 0) {
+			// flow with 4 fractional bits for the magnitude, truncated like the float version
+			const int64_t vx = ((c * Atb0 - b * Atb1) * 16) / det;
+			const int64_t vy = ((a * Atb1 - b * Atb0) * 16) / det;
+			const int64_t mag2 = (vx * vx + vy * vy) >> 8;
+			v->vx = (int16_t)mmax(mmin(vx / 16, INT16_MAX), INT16_MIN);
+			v->vy = (int16_t)mmax(mmin(vy / 16, INT16_MAX), INT16_MIN);
+			v->mag2 = (uint16_t)mmin(mag2, UINT16_MAX);
+			if(*max < v->mag2)
+				*max = v->mag2;
+		} else
+			v->vx = v->vy = v->mag2 = 0;
 	}
+}
+/** @} */
 
-	// ##Isotropic smooth
-	if(!convolve2DSeparable(image1, fx, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5)) {
-		return false;
+bool LK_optical_flow_fixed(MotionEstContext *ctx) {
+	const int w = ctx->width;
+	const int h = ctx->height;
+	const uint8_t *ref = ctx->data_ref, *cur = ctx->data_cur;
+	// ring of tensor rows and one row of int16 gradients : O(width) scratch
+	int32_t *buf = (int32_t*)ctx->workspace;
+	int16_t *fx = (int16_t*)(buf + WINDOW * LK_PRODUCTS * w), *fy = fx + w, *ft = fy + w;
+	int32_t *rows[WINDOW];
+	const bool grad_valid = ctx->lk_grad_frame && ctx->lk_grad_frame == ref;
+	// gradients and It are 12x the float ones, 24x with lk_reuse (sum of the ref and cur gradients)
+	const int scale = ctx->lk_grad ? 24 : 12;
+	const int64_t tau = ctx->lk_grad ? 4 * LK_TAU_FIXED : LK_TAU_FIXED;
+	LKGrid g;
+	int i, j, k, n;
+
+	lk_grid(&g, w, h, mmax(ctx->lk_stride, 1));
+	ctx->max = 0;
+	memset(buf, 0, WINDOW * LK_PRODUCTS * w * sizeof(int32_t));
+	memset(ctx->mv_table[0], 0, ctx->b_count * sizeof(*ctx->mv_table[0]));
+
+	for(i = 0; i < h; i++) {
+		if(!lk_row_needed(&g, i))
+			continue;
+		/* int16 gradients of row i : 12 Ix, 12 Iy, 12 It (zero padding like convH / convV) */
+		if(ctx->lk_grad) {
+			// lk_reuse : sum of the ref gradients (kept from the previous call) and the cur ones
+			int16_t *gx = ctx->lk_grad + i * w, *gy = gx + w * h;
+			if(!grad_valid)
+				grad12_row(ref, w, h, i, 0, w, gx, gy);
+			memcpy(fx, gx, w * sizeof(*fx));
+			memcpy(fy, gy, w * sizeof(*fy));
+			grad12_row(cur, w, h, i, 0, w, gx, gy);
+			for(j = 0; j < w; j++) {
+				fx[j] += gx[j];
+				fy[j] += gy[j];
+			}
+		} else
+			for(n = 0; n < g.span_n; n++) {
+				const int j0 = g.span_x0 + n * g.step;
+				grad12_row(ref, w, h, i, j0, j0 + g.span_w, fx, fy);
+			}
+		for(n = 0; n < g.span_n; n++)
+			for(j = g.span_x0 + n * g.step; j < g.span_x0 + n * g.step + g.span_w; j++)
+				ft[j] = scale * (cur[i * w + j] - ref[i * w + j]);
+		tensor_row_fixed(fx, fy, ft, w, &g, buf + (i % WINDOW) * LK_PRODUCTS * w);
+		if(!lk_row_solved(&g, i - half_window))
+			continue;
+		for(k = 0; k < WINDOW; k++)
+			rows[k] = buf + ((i + 1 + k) % WINDOW) * LK_PRODUCTS * w;
+		lk_solve_row_fixed(rows, w, &g, tau, ctx->mv_table[0] + ((i - half_window) / g.step) * ctx->b_width,
+				&ctx->max);
 	}
+	ctx->lk_grad_frame = cur;
+	return true;
+}
 
-	if(!convolve2DSeparable(image2, fy, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5)) {
+bool LK_optical_flow8(const uint8_t *src1, const uint8_t *src2, uint8_t *out, int w, int h) {
+	void *work;
+	bool ret;
+
+	if(w <= 0 || h <= 0)
 		return false;
-	}
-	
-	if(!convolve2DSeparable(ft, image2, w, h, Kernel_isotropic, 5, Kernel_isotropic, 5)) {
+	work = _malloc(me_lk_memory(LK_OPTICAL_FLOW_8BIT, w, h, 1));
+	if(!work) {
+		ESP_LOGE(TAG, "allocation failed!");
 		return false;
 	}
-	
-	memcpy(ft, image2, N * sizeof(float));
+	ret = LK_optical_flow8Buf(src1, src2, out, w, h, work);
+	free(work);
+	return ret;
+}
 
-	memset(out, 0, N);
-	// Lucas Kanade optical flow algorithm
-	for(i = half_window; i < h - half_window; ++i) {
-		for(j = half_window; j < w - half_window; ++j) {
-			float Atb0 = 0, Atb1 = 0; 
-			float a = 0, b = 0, c = 0;
-			for(m = 0; m < window_squared; ++m) {
-				// Sum over the window W²
-				const float W = kernel[m];
-				const int i_window = m / WINDOW - half_window;
-				const int j_window = m % WINDOW - half_window;
-                const unsigned index = (j + j_window) + (i + i_window) * w;
-				const float Ix = (float) fx[index] * W;
-				const float Iy = (float) fy[index] * W;
-				const float It = (float) ft[index] * W;
-				a += Ix * Ix;
-				c += Iy * Iy; 
-				b += Ix * Iy;
-				Atb0 += - Ix * It;
-				Atb1 += - Iy * It;
-			}
-			
-			//const float eigenval1 = ((a + c) + sqrtf(4 * b * b + powf(a - c, 2))) /2;
-			const float eigenval2 = ((a + c) - hypotf(2 * b, a - c)) * 0.5;
-
-			if(eigenval2 >= NoiseThreshold) {
-				//Case 1: λ1≥λ2≥τ equivalent to λ2≥τ
-				//A is nonsingular, the system of equations are solved using Cramer's rule.
-				const float det = a * c - b * b;
-				const float b_by_det = b / det;
-				const float iAtA[2][2] = {{  c / det, - b_by_det},
-										  {- b_by_det,   a / det}};
-				//optical flow : [Vx Vy] = inv[AtA] . Atb
-				const float vx = iAtA[0][0] * Atb0 + iAtA[0][1] * Atb1;
-				const float vy = iAtA[1][0] * Atb0 + iAtA[1][1] * Atb1;	
-				pMag = &tmpMagArray[i * w + j] ;
-				*pMag = (uint16_t)(vx * vx + vy * vy);
-				if(*pMag > maxMag)
-					maxMag = *pMag;
-			}
-		}
-    }
+bool LK_optical_flow8Buf(const uint8_t *src1, const uint8_t *src2, uint8_t *out, int w, int h, void *work) {
+	const int N = w * h;
+	float *grad = (float*)work;
+	// squared magnitudes after the gradients and the ring
+	LKMag mag = {.mag = (uint16_t*)(grad + LK_SMOOTH_SIZE(w, h, 1) + LK_RING_SIZE(w, 0)), .max = 0, .w = w};
+	const LKSource src = {.fx = grad, .fy = grad + N, .ft = grad + 2 * N, .w = w, .h = h};
+	LKGrid g;
+	int i;
+
+	if(!N || !src1 || !src2 || !out || !work)
+		return false;
 
-	for(pMag = &tmpMagArray[0], i = 0; i < N; i++, pMag++)
-		out[i] = (uint8_t)(*pMag * 255.0 / (float)maxMag);
+	if(!lk_smooth_gradients(src1, src2, w, h, grad, NULL))
+		return false;
+
+	memset(mag.mag, 0, N * sizeof(uint16_t));
+	// Lucas Kanade optical flow algorithm
+	lk_grid(&g, w, h, 1);
+	lk_flow(&src, &g, &emit_mag, &mag, grad + LK_SMOOTH_SIZE(w, h, 1), 0, h);
 
-	free(fx); free(image1);
-	free(fy); free(image2);
-	free(ft); free(tmpMagArray);
+	for(i = 0; i < N; i++)
+		out[i] = mag.max ? (uint8_t)(mag.mag[i] * 255.0 / (float)mag.max) : 0;
 	return true;
 }
+
+size_t me_lk_memory(int method, int w, int h, int threads) {
+	// one ring per band of LK_optical_flow
+	const size_t bands = me_parallel_count(threads, h);
+
+	switch (method) {
+		case LK_OPTICAL_FLOW:
+#if NOSMOOTH
+			return bands * LK_RING_SIZE(w, 1) * sizeof(float);
+#else
+			return (LK_SMOOTH_SIZE(w, h, threads) + bands * LK_RING_SIZE(w, 0)) * sizeof(float);
+#endif
+		case LK_OPTICAL_FLOW_FIXED:
+			return WINDOW * LK_PRODUCTS * w * sizeof(int32_t) + 3 * w * sizeof(int16_t);
+		case LK_OPTICAL_FLOW_8BIT:
+			return (LK_SMOOTH_SIZE(w, h, 1) + LK_RING_SIZE(w, 0)) * sizeof(float) + (size_t)w * h * sizeof(uint16_t);
+		default:
+			return 0;
+	}
+}
@@ -18,8 +18,6 @@
 static const char *TAG = "motion";
 #endif
 
-static int mv_allocated = 0;
-
 /** @brief  Safely free address
 	@param arg : address to be freed
  */
@@ -33,19 +31,50 @@ static void freep(void *arg) {
 
 
 void uninit(MotionEstContext *ctx) {
+    int i;
+
     if(ctx == NULL)
         return;
-    int i;
     ctx->data_ref = NULL;
     ctx->data_cur = NULL;
 
-    if(!mv_allocated || !ctx)
+    if(!ctx->allocated)
         return;
     
+    if (ctx->mbSize_saved) {
+        ctx->mbSize = ctx->caller_mbSize;
+        ctx->mbSize_saved = false;
+    }
     for (i = 0; i < 3; i++)
         freep(&ctx->mv_table[i]);
-    mv_allocated = 0;
-    ctx = NULL;
+    for (i = 0; i < 2; i++)
+        freep(&ctx->sum_table[i]);
+    ctx->sum_frame = NULL;
+    me_pyramid_free(ctx);
+    me_pool_destroy(ctx->pool);
+    ctx->pool = NULL;
+    freep(&ctx->es_cols);
+    freep(&ctx->pc_buf);
+    freep(&ctx->subpel_planes[0]);
+    freep(&ctx->mvq_table);
+    freep(&ctx->lk_grad);
+    ctx->lk_grad_frame = NULL;
+    if (ctx->workspace_owned) {
+        freep(&ctx->workspace);
+        ctx->workspace_size = 0;
+        ctx->workspace_owned = false;
+    }
+    ctx->allocated = false;
+}
+
+/** @brief  allocate DRAM that is byte-addressable */
+static void *_malloc(size_t size) {
+    void *res = malloc(size);
+
+    if(res)
+        return res;
+
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 }
 
 /** @brief  allocate DRAM that is byte-addressable 
@@ -59,58 +88,153 @@ static void *_calloc(size_t nb, size_t size) {
     return heap_caps_calloc(nb, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
 }
 
-bool init_context(MotionEstContext *ctx) {
+bool init_block_matching(MotionEstContext *ctx, int nb_tables) {
     int i;
-    if(mv_allocated)
+
+    assert(ctx->width > 4 * ctx->mbSize);
+    assert(ctx->width > 3 * ctx->mbSize);
+    // redefine as a closest 2^n size
+    ctx->log2_mbSize = ceil(log2(ctx->mbSize));
+    ctx->mbSize = 1 << ctx->log2_mbSize;
+
+    ctx->b_width  = ctx->width  >> ctx->log2_mbSize;
+    ctx->b_height = ctx->height >> ctx->log2_mbSize;
+    ctx->b_count  = ctx->b_width * ctx->b_height; 
+    for (i = 0; i < nb_tables; i++) {
+        ctx->mv_table[i] = (MotionVector16_t*)_calloc(ctx->b_count, sizeof(*ctx->mv_table[0]));
+        if (!ctx->mv_table[i]) {
+            ESP_LOGE(TAG, "alloction mv_table failed!");
+            return 0;
+        }
+    }
+
+    ctx->sad = me_sad_select(ctx->mbSize);
+    ctx->sad_x4 = me_sad_x4_select(ctx->mbSize);
+    ctx->sad_bounded = me_sad_bounded_select(ctx->mbSize);
+    ctx->get_cost = &me_comp_sad;
+    ctx->get_cost_bounded = &me_comp_sad_bounded;
+    ctx->get_cost_multi = &me_comp_sad_multi;
+    return 1;
+}
+
+size_t motion_query_memory(const MotionEstContext *ctx) {
+    switch (ctx->method) {
+        case LK_OPTICAL_FLOW_8BIT:
+        case LK_OPTICAL_FLOW:
+        case LK_OPTICAL_FLOW_FIXED:
+            return me_lk_memory(ctx->method, ctx->width, ctx->height, ctx->threads);
+        case HS_OPTICAL_FLOW:
+            return me_hs_memory(ctx->width, ctx->height);
+        case BLOCK_MATCHING_ARPS:
+            return me_arps_memory(ctx->search_param, ctx->threads);
+        default:
+            return 0;
+    }
+}
+
+/** @brief Use the caller workspace if large enough, otherwise allocate it */
+static bool workspace_alloc(MotionEstContext *ctx) {
+    const size_t size = motion_query_memory(ctx);
+
+    if (!ctx->workspace_owned && ctx->workspace) {
+        if (ctx->workspace_size >= size)
+            return 1;
+        ESP_LOGE(TAG, "workspace too small (%u < %u bytes)!", (unsigned)ctx->workspace_size, (unsigned)size);
+        return 0;
+    }
+    if (!size)
+        return 1;
+    ctx->workspace = _malloc(size);
+    if (!ctx->workspace) {
+        ESP_LOGE(TAG, "alloction workspace failed!");
+        return 0;
+    }
+    ctx->workspace_size = size;
+    ctx->workspace_owned = true;
+    return 1;
+}
+
+bool init_context(MotionEstContext *ctx) {
+    if(ctx->allocated)
         uninit(ctx);
+    // set first : uninit frees what a failed init_context allocated
+    ctx->allocated = true;
+
+    // the workers are started once for all the frames (and the pyramid levels)
+    ctx->pool = NULL;
+    if (ctx->threads > 1 && !(ctx->pool = me_pool_create(ctx->threads)))
+        ESP_LOGW(TAG, "threads not started, running serially");
         
     switch (ctx->method) {
+        case HS_OPTICAL_FLOW:
+        case LK_OPTICAL_FLOW_FIXED:
         case LK_OPTICAL_FLOW_8BIT:
         case LK_OPTICAL_FLOW:
-            ctx->mv_table[0] = (MotionVector16_t*)_calloc(ctx->width * ctx->height, sizeof(*ctx->mv_table[0]));
-            if (!ctx->mv_table[0]) {
-                ESP_LOGE(TAG, "alloction mv_table failed!");
-                return 0;
-            }
-            break;
-        case BLOCK_MATCHING_ARPS:
-            assert(ctx->width > 4 * ctx->mbSize);
-            assert(ctx->width > 3 * ctx->mbSize);
-            // redefine as a closest 2^n size
+            // one vector per pixel, or per lk_stride x lk_stride cell laid out like the block matching table :
+            // the cell size is published in mbSize (the caller's one is restored by uninit)
+            ctx->caller_mbSize = ctx->mbSize;
+            ctx->mbSize_saved = true;
+            ctx->mbSize = 1;
+            if (ctx->lk_stride > 1 && (ctx->method == LK_OPTICAL_FLOW || ctx->method == LK_OPTICAL_FLOW_FIXED))
+                ctx->mbSize = ctx->lk_stride = 1 << (int)ceil(log2(ctx->lk_stride));
             ctx->log2_mbSize = ceil(log2(ctx->mbSize));
-            ctx->mbSize = 1 << ctx->log2_mbSize;
-
             ctx->b_width  = ctx->width  >> ctx->log2_mbSize;
             ctx->b_height = ctx->height >> ctx->log2_mbSize;
-            ctx->b_count  = ctx->b_width * ctx->b_height; 
+            ctx->b_count  = ctx->b_width * ctx->b_height;
             ctx->mv_table[0] = (MotionVector16_t*)_calloc(ctx->b_count, sizeof(*ctx->mv_table[0]));
-            if (!ctx->mv_table[0]){
+            if (!ctx->mv_table[0]) {
                 ESP_LOGE(TAG, "alloction mv_table failed!");
                 return 0;
             }
-            break;
-        case BLOCK_MATCHING_EPZS:
-            assert(ctx->width > 4 * ctx->mbSize);
-            assert(ctx->width > 3 * ctx->mbSize);
-            // redefine as a closest 2^n size
-            ctx->log2_mbSize = ceil(log2(ctx->mbSize));
-            ctx->mbSize = 1 << ctx->log2_mbSize;
-
-            ctx->b_width  = ctx->width  >> ctx->log2_mbSize;
-            ctx->b_height = ctx->height >> ctx->log2_mbSize;
-            ctx->b_count  = ctx->b_width * ctx->b_height; 
-            for (i = 0; i < 3; i++) {
-                ctx->mv_table[i] = (MotionVector16_t*)_calloc(ctx->b_count, sizeof(*ctx->mv_table[0]));
-                if (!ctx->mv_table[i]) {
-                    ESP_LOGE(TAG, "alloction mv_table failed!");
+            if (ctx->lk_reuse && (ctx->method == LK_OPTICAL_FLOW || ctx->method == LK_OPTICAL_FLOW_FIXED)) {
+                ctx->lk_grad = (int16_t*)_calloc(2 * ctx->width * ctx->height, sizeof(*ctx->lk_grad));
+                ctx->lk_grad_frame = NULL;
+                if (!ctx->lk_grad) {
+                    ESP_LOGE(TAG, "alloction lk_grad failed!");
                     return 0;
                 }
             }
+            break;
+        case BLOCK_MATCHING_ARPS:
+            if (!init_block_matching(ctx, 1))
+                return 0;
+            break;
+        case BLOCK_MATCHING_EPZS:
+            if (!init_block_matching(ctx, 3))
+                return 0;
             break;    
+        case BLOCK_MATCHING_PYRAMID:
+            // finest level is an EPZS context, coarser levels are allocated by me_pyramid_alloc
+            if (!init_block_matching(ctx, 3) || !me_pyramid_alloc(ctx))
+                return 0;
+            break;
+        case BLOCK_MATCHING_ES:
+            if (!init_block_matching(ctx, 1))
+                return 0;
+            ctx->es_cols = (uint32_t*)_calloc(2 * ctx->width + ctx->b_width, sizeof(*ctx->es_cols));
+            if (!ctx->es_cols) {
+                ESP_LOGE(TAG, "alloction es_cols failed!");
+                return 0;
+            }
+            break;
+        case PHASE_CORRELATION:
+            if (!me_pc_alloc(ctx))
+                return 0;
+            break;
         default:  ESP_LOGE(TAG, "wrong method value"); return 0;
     }
-    mv_allocated = 1;
-    ctx->get_cost = &me_comp_sad;
+    if (!workspace_alloc(ctx))
+        return 0;
+    if (ctx->sea && ctx->method >= BLOCK_MATCHING_ARPS && ctx->method <= BLOCK_MATCHING_ES
+            && !me_sea_alloc(ctx)) {
+        ESP_LOGE(TAG, "alloction sum_table failed!");
+        return 0;
+    }
+    if (ctx->subpel && ctx->method >= BLOCK_MATCHING_ARPS && ctx->method <= BLOCK_MATCHING_ES
+            && !me_subpel_alloc(ctx)) {
+        ESP_LOGE(TAG, "alloction subpel planes failed!");
+        return 0;
+    }
     ctx->max = 0;
 
     return 1;
@@ -131,12 +255,15 @@ static bool LK_optical_flow_wrapper(MotionEstContext *c) {
 *   @return LK_optical_flow8
 */
 static bool LK_optical_flow8_wrapper(MotionEstContext *c) {
-    return LK_optical_flow8(c->data_ref, c->data_cur, c->data_ref, c->width, c->height);
+    return LK_optical_flow8Buf(c->data_ref, c->data_cur, c->data_ref, c->width, c->height, c->workspace);
 }
 
 bool motion_estimation(MotionEstContext *ctx, uint8_t *img_prev, uint8_t *img_cur) {
     ctx->data_cur = img_cur;
     ctx->data_ref = img_prev;
+    ctx->cost_count = 0;
+    ctx->cost_aborted = 0;
+    ctx->sea_rejected = 0;
 
     switch (ctx->method)
     {
@@ -146,36 +273,119 @@ bool motion_estimation(MotionEstContext *ctx, uint8_t *img_prev, uint8_t *img_cu
     case LK_OPTICAL_FLOW_8BIT   : ctx->motion_func = &LK_optical_flow8_wrapper;
         strcpy(ctx->name, "lucas kanade 8b");
         break;
+    case LK_OPTICAL_FLOW_FIXED  : ctx->motion_func = &LK_optical_flow_fixed;
+        strcpy(ctx->name, "lucas kanade fixed");
+        break;
+    case HS_OPTICAL_FLOW        : ctx->motion_func = &HS_optical_flow;
+        strcpy(ctx->name, "horn schunck");
+        break;
     case BLOCK_MATCHING_ARPS    : ctx->motion_func = &motionEstARPS;
         strcpy(ctx->name, "ARPS");
         break;    
     case BLOCK_MATCHING_EPZS    : ctx->motion_func = &motionEstEPZS;
         strcpy(ctx->name, "EPZS");
         break;
+    case BLOCK_MATCHING_PYRAMID : ctx->motion_func = &motionEstPyramid;
+        strcpy(ctx->name, "EPZS pyramid");
+        break;
+    case BLOCK_MATCHING_ES      : ctx->motion_func = &motionEstES;
+        strcpy(ctx->name, "ES");
+        break;
+    case PHASE_CORRELATION      : ctx->motion_func = &motionEstPhaseCorrelation;
+        strcpy(ctx->name, "phase correlation");
+        break;
     default:  ESP_LOGE(TAG, "wrong method value"); return 0;
     }
 
-    return ctx->motion_func(ctx);
+    me_sea_update(ctx);
+    if (!ctx->motion_func(ctx))
+        return 0;
+    return ctx->mvq_table ? me_subpel_refine(ctx) : 1;
 }
 
 uint64_t me_comp_sad(MotionEstContext *me_ctx, int x_mb, int y_mb, int x_mv, int y_mv) {
-    uint8_t *data_ref = me_ctx->data_ref;
-    uint8_t *data_cur = me_ctx->data_cur;
     const int linesize = me_ctx->width; //linesize;
-    uint64_t sad = 0;
-    int i, j;
 
-    data_ref += y_mv * linesize;
-    data_cur += y_mb * linesize;
+    me_ctx->cost_count++;
+    return me_ctx->sad(me_ctx->data_cur + y_mb * linesize + x_mb,
+                       me_ctx->data_ref + y_mv * linesize + x_mv, linesize, me_ctx->mbSize);
+}
+
+/** @brief SEA lower bound of the SAD : \f$ |\sum Cur - \sum Ref| \f$ */
+static inline uint32_t sea_bound(const MotionEstContext *me_ctx, int x_mb, int y_mb, int x_mv, int y_mv) {
+    const int s = me_ctx->width + 1;
+    const int n = me_ctx->mbSize, ns = me_ctx->mbSize * s;
+    const uint32_t *cur = me_ctx->sum_table[0] + y_mb * s + x_mb;
+    const uint32_t *ref = me_ctx->sum_table[1] + y_mv * s + x_mv;
+    const int32_t sum_cur = cur[ns + n] - cur[ns] - cur[n] + cur[0];
+    const int32_t sum_ref = ref[ns + n] - ref[ns] - ref[n] + ref[0];
+
+    return abs(sum_cur - sum_ref);
+}
 
-    for (j = 0; j < me_ctx->mbSize; j++) {
-        const int jlinesize = j * linesize;
-        for (i = 0; i < me_ctx->mbSize; i++)
-            sad += abs(data_ref[x_mv + i + jlinesize] - data_cur[x_mb + i + jlinesize]);
+uint64_t me_comp_sad_bounded(MotionEstContext *me_ctx, int x_mb, int y_mb, int x_mv, int y_mv, uint64_t limit) {
+    const int linesize = me_ctx->width;
+
+    if (me_ctx->sum_table[0]) {
+        const uint32_t bound = sea_bound(me_ctx, x_mb, y_mb, x_mv, y_mv);
+        if (bound >= limit) {
+            me_ctx->sea_rejected++;
+            return bound | ME_SAD_ABORTED;
+        }
     }
+
+    const uint32_t sad = me_ctx->sad_bounded(me_ctx->data_cur + y_mb * linesize + x_mb,
+                                             me_ctx->data_ref + y_mv * linesize + x_mv, linesize,
+                                             me_ctx->mbSize, (uint32_t)mmin(limit, (uint64_t)UINT32_MAX));
+    me_ctx->cost_count++;
+    if (sad & ME_SAD_ABORTED)
+        me_ctx->cost_aborted++;
     return sad;
 }
 
+void me_comp_sad_multi(MotionEstContext *me_ctx, int x_mb, int y_mb, const int (*mv)[2], int n,
+                       uint64_t limit, uint64_t *cost) {
+    const int linesize = me_ctx->width;
+    const uint8_t *data_cur = me_ctx->data_cur + y_mb * linesize + x_mb;
+    const uint32_t limit32 = (uint32_t)mmin(limit, (uint64_t)UINT32_MAX);
+    const uint8_t *ref[4];
+    uint32_t sad[4];
+    int idx[n > 0 ? n : 1];
+    int i, k, m = 0;
+
+    // SEA : only the candidates which could beat limit are scored
+    for (i = 0; i < n; i++) {
+        if (me_ctx->sum_table[0]) {
+            const uint32_t bound = sea_bound(me_ctx, x_mb, y_mb, mv[i][0], mv[i][1]);
+            if (bound >= limit) {
+                me_ctx->sea_rejected++;
+                cost[i] = bound | ME_SAD_ABORTED;
+                continue;
+            }
+        }
+        idx[m++] = i;
+    }
+
+    for (i = 0; i < m; i += 4) {
+        const int nb = mmin(m - i, 4);
+        if (nb == 1) {
+            cost[idx[i]] = me_comp_sad_bounded(me_ctx, x_mb, y_mb, mv[idx[i]][0], mv[idx[i]][1], limit);
+            break;
+        }
+        // less than 4 candidates left : the last one is scored several times
+        for (k = 0; k < 4; k++) {
+            const int c = idx[i + mmin(k, nb - 1)];
+            ref[k] = me_ctx->data_ref + mv[c][1] * linesize + mv[c][0];
+        }
+        me_ctx->sad_x4(data_cur, ref, linesize, me_ctx->mbSize, limit32, sad);
+        me_ctx->cost_count += nb;
+        if (sad[0] & ME_SAD_ABORTED)
+            me_ctx->cost_aborted += nb;
+        for (k = 0; k < nb; k++)
+            cost[idx[i + k]] = sad[k];
+    }
+}
+
 //#TODO Post processing motion filtering
 /*
 // Limit min magnitude and number min magnitude to filter
@@ -0,0 +1,92 @@
+/** @file multi_stream.c
+*   @brief Independent motion estimation streams run in parallel by a pool of workers
+*
+*   @author Thomas Pegot
+*/
+
+#include "multi_stream.h"
+#include <string.h>
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "multi_stream";
+#endif
+
+bool me_streams_init(MotionEstStreams *ms, MotionEstStream *streams, int count) {
+    int s;
+
+    ms->streams = streams;
+    ms->count = count;
+    ms->pool = NULL;
+    for (s = 0; s < count; s++) {
+        MotionEstStream *st = &streams[s];
+        // a stream runs on one worker : no pool per context
+        st->ctx.threads = 0;
+        memset(&st->deflicker_queue, 0, sizeof(st->deflicker_queue));
+        st->frames = 0;
+        if (!init_context(&st->ctx)) {
+            ESP_LOGE(TAG, "init of stream %d failed!", s);
+            return false;
+        }
+    }
+    if (ms->threads > 1 && !(ms->pool = me_pool_create(ms->threads)))
+        ESP_LOGW(TAG, "threads not started, running serially");
+    return true;
+}
+
+void me_streams_uninit(MotionEstStreams *ms) {
+    int s;
+
+    me_pool_destroy(ms->pool);
+    ms->pool = NULL;
+    for (s = 0; s < ms->count; s++)
+        uninit(&ms->streams[s].ctx);
+}
+
+/** @brief frames of the streams [begin, end) in batch order */
+static void streams_band(void *arg, int worker, int begin, int end) {
+    MotionEstStreams *ms = (MotionEstStreams*)arg;
+    int s, i;
+    (void)worker;
+
+    for (s = begin; s < end; s++) {
+        MotionEstStream *st = &ms->streams[s];
+        for (i = 0; i < ms->batch_size; i++) {
+            MotionEstFrame *f = &ms->batch[i];
+            if (f->stream != s)
+                continue;
+            if (st->deflicker)
+                deflicker_r(&st->deflicker_queue, f->img_cur, st->ctx.width, st->ctx.height);
+            f->ok = motion_estimation(&st->ctx, f->img_prev, f->img_cur);
+            st->frames++;
+            if (ms->done)
+                ms->done(ms->user, f, &st->ctx);
+        }
+    }
+}
+
+bool me_streams_run(MotionEstStreams *ms, MotionEstFrame *batch, int n) {
+    bool ok = true;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        batch[i].ok = false;
+        if (batch[i].stream < 0 || batch[i].stream >= ms->count) {
+            ESP_LOGE(TAG, "frame %d : wrong stream %d", i, batch[i].stream);
+            ok = false;
+        }
+    }
+    ms->batch = batch;
+    ms->batch_size = n;
+    // a tile is a stream : idle workers steal the streams left to the busy ones
+    me_parallel_tiles(ms->pool, ms->count, 1, &streams_band, ms);
+    ms->batch = NULL;
+    ms->batch_size = 0;
+
+    for (i = 0; i < n; i++)
+        ok &= batch[i].ok;
+    return ok;
+}
@@ -0,0 +1,259 @@
+/** @file parallel.c
+*   @brief Bands of rows (or blocks) run in parallel by pthreads, started per call or kept in a pool
+*
+*   @author Thomas Pegot
+*/
+
+#include "parallel.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_pthread.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#endif
+
+/** @brief arguments of the thread of one band */
+typedef struct {
+	me_band_func func;
+	void *arg;
+	int band, begin, end;
+} MEBand;
+
+static void *band_thread(void *p) {
+	MEBand *b = (MEBand*)p;
+	b->func(b->arg, b->band, b->begin, b->end);
+	return NULL;
+}
+
+bool me_thread_create(pthread_t *tid, void *(*func)(void *), void *arg, int core, int stack) {
+	bool ok;
+#ifdef ESP_PLATFORM
+	esp_pthread_cfg_t cfg_old, cfg = esp_pthread_get_default_config();
+	const bool has_cfg = esp_pthread_get_cfg(&cfg_old) == ESP_OK;
+
+	cfg.stack_size = stack;
+	cfg.pin_to_core = (xPortGetCoreID() + core) % portNUM_PROCESSORS;
+	esp_pthread_set_cfg(&cfg);
+#else
+	(void)core; (void)stack;
+#endif
+	ok = pthread_create(tid, NULL, func, arg) == 0;
+#ifdef ESP_PLATFORM
+	if (has_cfg)
+		esp_pthread_set_cfg(&cfg_old);
+	else {
+		cfg = esp_pthread_get_default_config();
+		esp_pthread_set_cfg(&cfg);
+	}
+#endif
+	return ok;
+}
+
+int me_threads(int threads) {
+	return threads < 1 ? 1 : threads > ME_THREADS_MAX ? ME_THREADS_MAX : threads;
+}
+
+int me_parallel_count(int threads, int n) {
+	threads = me_threads(threads);
+	return n < threads ? (n > 0 ? n : 1) : threads;
+}
+
+int me_parallel_bands(int threads, int n, me_band_func func, void *arg) {
+	const int bands = me_parallel_count(threads, n);
+	MEBand band[ME_THREADS_MAX];
+	pthread_t tid[ME_THREADS_MAX];
+	bool started[ME_THREADS_MAX] = {false};
+	int b;
+
+	for (b = 0; b < bands; b++) {
+		band[b].func = func;
+		band[b].arg = arg;
+		band[b].band = b;
+		band[b].begin = (int)((long long)n * b / bands);
+		band[b].end = (int)((long long)n * (b + 1) / bands);
+	}
+
+	// spread the bands over the cores, starting with the one after the caller's
+	for (b = 1; b < bands; b++)
+		started[b] = me_thread_create(&tid[b], band_thread, &band[b], b, ME_THREAD_STACK);
+
+	band_thread(&band[0]);
+	for (b = 1; b < bands; b++) {
+		if (started[b])
+			pthread_join(tid[b], NULL);
+		else
+			band_thread(&band[b]);
+	}
+	return bands;
+}
+
+/** max tiles of a me_parallel_tiles call : first and end tile of a share are packed in 16 bits each */
+#define ME_TILES_MAX 0xffff
+
+/** @brief worker of a pool and its index */
+typedef struct {
+	MEPool *pool;
+	int index;
+} MEWorker;
+
+struct MEPool {
+	int threads;						///< workers, caller included
+	pthread_t tid[ME_THREADS_MAX];
+	MEWorker worker[ME_THREADS_MAX];
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned job;						///< incremented for each me_parallel_tiles call
+	int running;						///< threads still working on the job
+	bool quit;
+
+	/* current job */
+	me_band_func func;
+	void *arg;
+	int n, tile, workers;
+	atomic_uint share[ME_THREADS_MAX];	///< tiles left to each worker : first | end << 16
+};
+
+/** @brief take the first (or last) tile of a share, -1 if it is empty */
+static int tile_take(atomic_uint *share, bool last) {
+	unsigned s = atomic_load_explicit(share, memory_order_relaxed);
+	unsigned first, end;
+
+	do {
+		first = s & ME_TILES_MAX;
+		end = s >> 16;
+		if (first >= end)
+			return -1;
+	} while (!atomic_compare_exchange_weak(share, &s, last ? first | (end - 1) << 16 : (first + 1) | end << 16));
+	return last ? (int)end - 1 : (int)first;
+}
+
+/** @brief tiles of worker w, then the ones stolen to the others */
+static void pool_work(MEPool *p, int w) {
+	int t, v;
+
+	if (w >= p->workers)
+		return;
+	for (;;) {
+		t = tile_take(&p->share[w], false);
+		for (v = 1; t < 0 && v < p->workers; v++)
+			t = tile_take(&p->share[(w + v) % p->workers], true);
+		if (t < 0)
+			return;
+		p->func(p->arg, w, t * p->tile, (t + 1) * p->tile < p->n ? (t + 1) * p->tile : p->n);
+	}
+}
+
+static void *pool_thread(void *arg) {
+	MEWorker *w = (MEWorker*)arg;
+	MEPool *p = w->pool;
+	unsigned job = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->job == job && !p->quit)
+			pthread_cond_wait(&p->start, &p->lock);
+		if (p->quit)
+			break;
+		job = p->job;
+		pthread_mutex_unlock(&p->lock);
+
+		pool_work(p, w->index);
+
+		pthread_mutex_lock(&p->lock);
+		if (--p->running == 0)
+			pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+MEPool *me_pool_create(int threads) {
+	MEPool *p;
+	int w;
+
+	threads = me_threads(threads);
+	if (threads < 2 || !(p = (MEPool*)calloc(1, sizeof(*p))))
+		return NULL;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	// spread the workers over the cores, starting with the one after the caller's.
+	// Workers are numbered without holes : stop at the first one which can't be started
+	for (w = 1; w < threads; w++) {
+		p->worker[w].pool = p;
+		p->worker[w].index = w;
+		if (!me_thread_create(&p->tid[w], pool_thread, &p->worker[w], w, ME_THREAD_STACK))
+			break;
+	}
+	p->threads = w;
+	if (w < 2) {
+		me_pool_destroy(p);
+		return NULL;
+	}
+	return p;
+}
+
+void me_pool_destroy(MEPool *pool) {
+	int w;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (w = 1; w < pool->threads; w++)
+		pthread_join(pool->tid[w], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+int me_pool_threads(const MEPool *pool) {
+	return pool ? pool->threads : 1;
+}
+
+int me_parallel_tiles(MEPool *pool, int n, int tile, me_band_func func, void *arg) {
+	int tiles, w;
+
+	if (!pool || n <= 1) {
+		func(arg, 0, 0, n);
+		return 1;
+	}
+	if (tile <= 0)
+		tile = (n + pool->threads - 1) / pool->threads;
+	if ((n + tile - 1) / tile > ME_TILES_MAX)
+		tile = (n + ME_TILES_MAX - 1) / ME_TILES_MAX;
+	tiles = (n + tile - 1) / tile;
+	if (tiles == 1) {
+		func(arg, 0, 0, n);
+		return 1;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->arg = arg;
+	pool->n = n;
+	pool->tile = tile;
+	pool->workers = tiles < pool->threads ? tiles : pool->threads;
+	for (w = 0; w < pool->workers; w++)
+		atomic_store(&pool->share[w], (unsigned)(tiles * w / pool->workers)
+		                              | (unsigned)(tiles * (w + 1) / pool->workers) << 16);
+	pool->running = pool->threads - 1;
+	pool->job++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_work(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+	return pool->workers;
+}
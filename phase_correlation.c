@@ -0,0 +1,285 @@
+/** @file phase_correlation.c
+*   @brief Global (and per tile) translation by phase correlation, radix-2 FFT included
+*   @author Thomas Pegot
+*/
+
+#include "motion.h"
+#include <math.h>
+#include <string.h>
+#include "esp_heap_caps.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "phase_correlation";
+#endif
+
+/** @brief max side of the (power of 2) window used for the global shift, centred in the frame */
+#define PC_SIZE_MAX 128
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/** @brief  allocate DRAM that is byte-addressable */
+static void *_malloc(size_t size) {
+    void *res = malloc(size);
+    if(res)
+        return res;
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+/** @brief  allocate zeroed DRAM that is byte-addressable */
+static void *_calloc(size_t nb, size_t size) {
+    void *res = calloc(nb, size);
+    if(res)
+        return res;
+    return heap_caps_calloc(nb, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+/** @brief largest power of 2 lower or equal to n (capped to PC_SIZE_MAX) */
+static int pow2_floor(int n) {
+    int p = 1;
+    while ((p << 1) <= n && (p << 1) <= PC_SIZE_MAX)
+        p <<= 1;
+    return p;
+}
+
+/** @brief Hann window of size n */
+static void hann(float *win, int n) {
+    int i;
+    for (i = 0; i < n; i++)
+        win[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / n);
+}
+
+/**
+ * @brief in-place iterative radix-2 FFT of n complex (interleaved re, im)
+ * @param tw     twiddles \f$ e^{-2i\pi k / tw_n} \f$ for \f$ k < tw_n / 2 \f$
+ * @param tw_n   size the twiddles were computed for (multiple of n)
+ * @param inverse  big if true (not normalised)
+ */
+static void fft(float *z, int n, const float *tw, int tw_n, bool inverse) {
+    int i, j, k, len;
+
+    // bit reversal permutation
+    for (i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            float t;
+            t = z[2 * i];     z[2 * i]     = z[2 * j];     z[2 * j]     = t;
+            t = z[2 * i + 1]; z[2 * i + 1] = z[2 * j + 1]; z[2 * j + 1] = t;
+        }
+    }
+
+    for (len = 2; len <= n; len <<= 1) {
+        const int half = len >> 1;
+        const int step = tw_n / len;
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < half; k++) {
+                const float wr = tw[2 * k * step];
+                const float wi = inverse ? -tw[2 * k * step + 1] : tw[2 * k * step + 1];
+                float *a = z + 2 * (i + k), *b = a + 2 * half;
+                const float br = b[0] * wr - b[1] * wi;
+                const float bi = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - br; b[1] = a[1] - bi;
+                a[0] += br;       a[1] += bi;
+            }
+        }
+    }
+}
+
+/** @brief 2D FFT of a w x h complex image : rows then columns (through tmp of h complex) */
+static void fft2(float *z, int w, int h, float *tmp, const float *tw, int tw_n, bool inverse) {
+    int x, y;
+
+    for (y = 0; y < h; y++)
+        fft(z + 2 * y * w, w, tw, tw_n, inverse);
+    for (x = 0; x < w; x++) {
+        for (y = 0; y < h; y++) {
+            tmp[2 * y]     = z[2 * (y * w + x)];
+            tmp[2 * y + 1] = z[2 * (y * w + x) + 1];
+        }
+        fft(tmp, h, tw, tw_n, inverse);
+        for (y = 0; y < h; y++) {
+            z[2 * (y * w + x)]     = tmp[2 * y];
+            z[2 * (y * w + x) + 1] = tmp[2 * y + 1];
+        }
+    }
+}
+
+/** @brief normalised cross power spectrum of the cur / ref spectra packed in z (k and -k at once) */
+static void cross_power(float *z, int w, int h) {
+    int u, v;
+
+    for (v = 0; v < h; v++) {
+        for (u = 0; u < w; u++) {
+            const int k = v * w + u;
+            const int kn = ((h - v) & (h - 1)) * w + ((w - u) & (w - 1));
+            float zk[2], zn[2];
+            int s;
+
+            if (kn < k)
+                continue; // done with its conjugate
+            zk[0] = z[2 * k];  zk[1] = z[2 * k + 1];
+            zn[0] = z[2 * kn]; zn[1] = z[2 * kn + 1];
+            for (s = 0; s < 2; s++) {
+                // Z = C + iR with C, R spectra of real images : C = (Z(k) + Z*(-k)) / 2, R = (Z(k) - Z*(-k)) / 2i
+                const float *a = s ? zn : zk, *b = s ? zk : zn;
+                const float cr = 0.5f * (a[0] + b[0]), ci = 0.5f * (a[1] - b[1]);
+                const float rr = 0.5f * (a[1] + b[1]), ri = 0.5f * (b[0] - a[0]);
+                // R . conj(C) / |R . conj(C)|
+                const float pr = rr * cr + ri * ci, pi = ri * cr - rr * ci;
+                const float m = sqrtf(pr * pr + pi * pi) + 1e-9f;
+                float *o = z + 2 * (s ? kn : k);
+                o[0] = pr / m;
+                o[1] = pi / m;
+            }
+        }
+    }
+}
+
+/** @brief vertex of the parabola through (-1, l), (0, c), (1, r) */
+static inline float parabola(float l, float c, float r) {
+    const float d = l - 2.0f * c + r;
+    return d < 0.0f ? 0.5f * (l - r) / d : 0.0f;
+}
+
+/**
+ * @brief Shift between the w x h windows at cur and ref
+ *
+ *  vector (dx, dy) such as \f$ Cur(x, y) \approx Ref(x + dx, y + dy) \f$ like block matching vectors
+ * @return height of the correlation peak in [0, 1]
+ */
+static float pc_shift(MotionEstContext *ctx, const uint8_t *cur, const uint8_t *ref, int w, int h,
+                      const float *win_x, const float *win_y, float *dx, float *dy) {
+    const int linesize = ctx->width;
+    const int tw_n = ctx->pc_tw_n;
+    float *z = ctx->pc_buf, *tmp = z + 2 * ctx->pc_size[0] * ctx->pc_size[1];
+    const float *tw = tmp + 2 * tw_n;
+    uint32_t sum_c = 0, sum_r = 0;
+    float mean_c, mean_r, peak = -1.0f;
+    int x, y, px = 0, py = 0;
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            sum_c += cur[y * linesize + x];
+            sum_r += ref[y * linesize + x];
+        }
+    mean_c = (float)sum_c / (w * h);
+    mean_r = (float)sum_r / (w * h);
+
+    // both real images in one complex FFT : cur as real part, ref as imaginary part
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            const float g = win_y[y] * win_x[x];
+            z[2 * (y * w + x)]     = g * (cur[y * linesize + x] - mean_c);
+            z[2 * (y * w + x) + 1] = g * (ref[y * linesize + x] - mean_r);
+        }
+    fft2(z, w, h, tmp, tw, tw_n, false);
+    cross_power(z, w, h);
+    fft2(z, w, h, tmp, tw, tw_n, true);
+
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++)
+            if (z[2 * (y * w + x)] > peak) {
+                peak = z[2 * (y * w + x)];
+                px = x;
+                py = y;
+            }
+
+    // sub-pixel peak : parabola along each axis (correlation is circular)
+#define PC_AT(x, y) z[2 * ((((y) + h) & (h - 1)) * w + (((x) + w) & (w - 1)))]
+    *dx = (px >= w / 2 ? px - w : px) + parabola(PC_AT(px - 1, py), peak, PC_AT(px + 1, py));
+    *dy = (py >= h / 2 ? py - h : py) + parabola(PC_AT(px, py - 1), peak, PC_AT(px, py + 1));
+#undef PC_AT
+    return peak / (w * h);
+}
+
+bool me_pc_alloc(MotionEstContext *ctx) {
+    const int tile = ctx->mbSize;
+    int n, i;
+    float *tw;
+
+    ctx->pc_size[0] = pow2_floor(ctx->width);
+    ctx->pc_size[1] = pow2_floor(ctx->height);
+    if (tile) {
+        // per tile shifts on the block grid
+        ctx->log2_mbSize = ceil(log2(tile));
+        ctx->mbSize = mmin(1 << ctx->log2_mbSize, PC_SIZE_MAX);
+        ctx->log2_mbSize = log2(ctx->mbSize);
+        ctx->b_width  = ctx->width  >> ctx->log2_mbSize;
+        ctx->b_height = ctx->height >> ctx->log2_mbSize;
+    } else
+        ctx->b_width = ctx->b_height = 1;
+    ctx->b_count = ctx->b_width * ctx->b_height;
+    if (!ctx->b_count) {
+        ESP_LOGE(TAG, "mbSize too large!");
+        return false;
+    }
+
+    ctx->mv_table[0] = (MotionVector16_t*)_calloc(ctx->b_count, sizeof(*ctx->mv_table[0]));
+    n = mmax(mmax(ctx->pc_size[0], ctx->pc_size[1]), ctx->mbSize);
+    ctx->pc_tw_n = n;
+    // z, tmp, twiddles, global windows, tile window
+    ctx->pc_buf = (float*)_malloc(sizeof(float) * (2 * ctx->pc_size[0] * ctx->pc_size[1] + 2 * n + n
+                                  + ctx->pc_size[0] + ctx->pc_size[1] + ctx->mbSize));
+    if (!ctx->mv_table[0] || !ctx->pc_buf) {
+        ESP_LOGE(TAG, "allocation failed!");
+        return false;
+    }
+    if (ctx->mbSize * ctx->mbSize > ctx->pc_size[0] * ctx->pc_size[1]) {
+        ESP_LOGE(TAG, "mbSize larger than the global window!");
+        return false;
+    }
+
+    tw = ctx->pc_buf + 2 * ctx->pc_size[0] * ctx->pc_size[1] + 2 * n;
+    for (i = 0; i < n / 2; i++) {
+        tw[2 * i]     =  cosf(2.0f * M_PI * i / n);
+        tw[2 * i + 1] = -sinf(2.0f * M_PI * i / n);
+    }
+    hann(tw + n, ctx->pc_size[0]);
+    hann(tw + n + ctx->pc_size[0], ctx->pc_size[1]);
+    hann(tw + n + ctx->pc_size[0] + ctx->pc_size[1], ctx->mbSize);
+    return true;
+}
+
+bool motionEstPhaseCorrelation(MotionEstContext *ctx) {
+    const int w = ctx->pc_size[0], h = ctx->pc_size[1];
+    const int x0 = (ctx->width - w) >> 1, y0 = (ctx->height - h) >> 1;
+    const int n = ctx->pc_tw_n;
+    const float *win = ctx->pc_buf + 2 * w * h + 3 * n;
+    const float *win_t = win + w + h;
+    const int offset = y0 * ctx->width + x0;
+    MotionVector16_t *mv = ctx->mv_table[0];
+    float dx, dy;
+    int mb_x, mb_y;
+
+    ctx->pc_peak = pc_shift(ctx, ctx->data_cur + offset, ctx->data_ref + offset, w, h,
+                            win, win + w, &ctx->pc_dx, &ctx->pc_dy);
+
+    ctx->max = 0;
+    if (!ctx->mbSize) {
+        mv->vx = lroundf(ctx->pc_dx);
+        mv->vy = lroundf(ctx->pc_dy);
+        mv->mag2 = mv->vx * mv->vx + mv->vy * mv->vy;
+        ctx->max = mv->mag2;
+        return 1;
+    }
+
+    for (mb_y = 0; mb_y < ctx->b_height; mb_y++)
+        for (mb_x = 0; mb_x < ctx->b_width; mb_x++, mv++) {
+            const int offset = (mb_y * ctx->width + mb_x) << ctx->log2_mbSize;
+            pc_shift(ctx, ctx->data_cur + offset, ctx->data_ref + offset, ctx->mbSize, ctx->mbSize,
+                     win_t, win_t, &dx, &dy);
+            mv->vx = lroundf(dx);
+            mv->vy = lroundf(dy);
+            mv->mag2 = mv->vx * mv->vx + mv->vy * mv->vy;
+            ctx->max = mmax(ctx->max, mv->mag2);
+        }
+    return 1;
+}
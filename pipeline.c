@@ -0,0 +1,260 @@
+/** @file pipeline.c
+*   @brief Pipelined motion estimation : pre-processing and estimation stages in their own threads
+*
+*   @author Thomas Pegot
+*/
+
+#include "pipeline.h"
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_heap_caps.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "pipeline";
+#endif
+
+/** stack of the stage threads, the estimation one runs motion_estimation */
+#define ME_PIPE_STACK 8192
+
+#define ME_PIPE_SLOTS (2 * ME_PIPE_DEPTH_MAX)
+
+/** queues of a pipeline, from one stage to the next */
+enum { FREE_Q, PRE_Q, ME_Q, OUT_Q, QUEUES };
+
+struct MEPipeQueue {
+    MEPipeFrame *slot[ME_PIPE_SLOTS];   ///< depth records and the end marker always fit
+    atomic_uint head;                   ///< next slot to pop, written by the consumer only
+    atomic_uint tail;                   ///< next slot to push, written by the producer only
+    atomic_bool waiting;                ///< consumer sleeping on cond
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/** @brief  allocate DRAM that is byte-addressable */
+static void *_malloc(size_t size) {
+    void *res = malloc(size);
+    if(res)
+        return res;
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+static void queue_init(MEPipeQueue *q) {
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->waiting, false);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_destroy(MEPipeQueue *q) {
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+/** @brief producer side. Never full : a queue has room for all the records and the end marker */
+static void queue_push(MEPipeQueue *q, MEPipeFrame *f) {
+    const unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    q->slot[tail % ME_PIPE_SLOTS] = f;
+    // sequentially consistent with the load of waiting : either the consumer sees the frame
+    // before going to sleep, or it is asleep (or about to be) and gets signaled
+    atomic_store(&q->tail, tail + 1);
+    if (atomic_load(&q->waiting)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/** @brief consumer side, NULL if empty and !wait */
+static MEPipeFrame *queue_pop(MEPipeQueue *q, bool wait) {
+    const unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    MEPipeFrame *f;
+
+    if (atomic_load_explicit(&q->tail, memory_order_acquire) == head) {
+        if (!wait)
+            return NULL;
+        pthread_mutex_lock(&q->lock);
+        atomic_store(&q->waiting, true);
+        while (atomic_load(&q->tail) == head)
+            pthread_cond_wait(&q->cond, &q->lock);
+        atomic_store(&q->waiting, false);
+        pthread_mutex_unlock(&q->lock);
+    }
+    f = q->slot[head % ME_PIPE_SLOTS];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return f;
+}
+
+static void pipe_pre(MEPipeline *p, MEPipeFrame *f) {
+    if (p->deflicker)
+        deflicker_r(&p->deflicker_queue, f->img, p->ctx.width, p->ctx.height);
+    if (p->pre)
+        p->pre(p->pre_user, f->img, p->ctx.width, p->ctx.height);
+}
+
+static void pipe_estimate(MEPipeline *p, MEPipeFrame *f) {
+    MotionEstContext *ctx = &p->ctx;
+
+    if (p->prev) {
+        f->ok = motion_estimation(ctx, p->prev, f->img);
+        f->max = ctx->max;
+        memcpy(f->mv, ctx->mv_table[0], ctx->b_count * sizeof(*f->mv));
+    } else
+        memset(f->mv, 0, ctx->b_count * sizeof(*f->mv));
+    f->img_released = p->prev;
+    p->prev = f->img;
+}
+
+static void *pre_thread(void *arg) {
+    MEPipeline *p = (MEPipeline*)arg;
+    MEPipeFrame *f;
+    bool end;
+
+    do {
+        f = queue_pop(&p->queue[PRE_Q], true);
+        end = f->end;
+        if (!end)
+            pipe_pre(p, f);
+        // f belongs to the next stage once pushed
+        queue_push(&p->queue[ME_Q], f);
+    } while (!end);
+    return NULL;
+}
+
+static void *me_thread(void *arg) {
+    MEPipeline *p = (MEPipeline*)arg;
+    MEPipeFrame *f;
+    bool end;
+
+    do {
+        f = queue_pop(&p->queue[ME_Q], true);
+        end = f->end;
+        if (!end)
+            pipe_estimate(p, f);
+        // f belongs to the next stage once pushed
+        queue_push(&p->queue[OUT_Q], f);
+    } while (!end);
+    return NULL;
+}
+
+bool me_pipeline_init(MEPipeline *p) {
+    const int depth = p->depth > 0 ? mmin(p->depth, ME_PIPE_DEPTH_MAX) : ME_PIPE_DEPTH;
+    int i;
+
+    memset(&p->deflicker_queue, 0, sizeof(p->deflicker_queue));
+    memset(&p->end, 0, sizeof(p->end));
+    p->end.end = true;
+    p->mv = NULL;
+    p->prev = NULL;
+    p->threaded = p->closed = p->ended = false;
+
+    if (!(p->queue = (MEPipeQueue*)calloc(QUEUES, sizeof(*p->queue)))) {
+        ESP_LOGE(TAG, "allocation failed!");
+        return false;
+    }
+    for (i = 0; i < QUEUES; i++)
+        queue_init(&p->queue[i]);
+    if (!init_context(&p->ctx)) {
+        ESP_LOGE(TAG, "init of the context failed!");
+        return false;
+    }
+    p->mv = (MotionVector16_t*)_malloc(depth * p->ctx.b_count * sizeof(*p->mv));
+    if (!p->mv) {
+        ESP_LOGE(TAG, "allocation failed!");
+        return false;
+    }
+    for (i = 0; i < depth; i++) {
+        p->frame[i].mv = p->mv + i * p->ctx.b_count;
+        queue_push(&p->queue[FREE_Q], &p->frame[i]);
+    }
+
+    // estimation on the core after the caller's one, pre-processing next to the capture
+    if (me_thread_create(&p->tid[1], me_thread, p, 1, ME_PIPE_STACK)) {
+        if (me_thread_create(&p->tid[0], pre_thread, p, 0, ME_PIPE_STACK))
+            p->threaded = true;
+        else {
+            queue_push(&p->queue[ME_Q], &p->end);
+            pthread_join(p->tid[1], NULL);
+            queue_pop(&p->queue[OUT_Q], true);
+        }
+    }
+    if (!p->threaded)
+        ESP_LOGW(TAG, "threads not started, running serially");
+    return true;
+}
+
+bool me_pipeline_push(MEPipeline *p, uint8_t *img, void *user, bool wait) {
+    MEPipeFrame *f;
+
+    if (p->closed) {
+        ESP_LOGE(TAG, "pipeline closed!");
+        return false;
+    }
+    if (!(f = queue_pop(&p->queue[FREE_Q], wait)))
+        return false;
+    f->img = img;
+    f->user = user;
+    f->img_released = NULL;
+    f->ok = false;
+    f->max = 0;
+    f->end = false;
+    if (p->threaded)
+        queue_push(&p->queue[PRE_Q], f);
+    else {
+        pipe_pre(p, f);
+        pipe_estimate(p, f);
+        queue_push(&p->queue[OUT_Q], f);
+    }
+    return true;
+}
+
+MEPipeFrame *me_pipeline_pop(MEPipeline *p, bool wait) {
+    MEPipeFrame *f;
+
+    if (p->ended || !(f = queue_pop(&p->queue[OUT_Q], wait)))
+        return NULL;
+    if (f->end) {
+        p->ended = true;
+        return NULL;
+    }
+    return f;
+}
+
+void me_pipeline_release(MEPipeline *p, MEPipeFrame *f) {
+    queue_push(&p->queue[FREE_Q], f);
+}
+
+void me_pipeline_close(MEPipeline *p) {
+    if (p->closed)
+        return;
+    p->closed = true;
+    queue_push(p->threaded ? &p->queue[PRE_Q] : &p->queue[OUT_Q], &p->end);
+}
+
+void me_pipeline_uninit(MEPipeline *p) {
+    int i;
+
+    if (p->threaded) {
+        // the end marker goes through the stages : both threads return
+        me_pipeline_close(p);
+        while (me_pipeline_pop(p, true))
+            ;
+        pthread_join(p->tid[0], NULL);
+        pthread_join(p->tid[1], NULL);
+        p->threaded = false;
+    }
+    if (p->queue) {
+        for (i = 0; i < QUEUES; i++)
+            queue_destroy(&p->queue[i]);
+        free(p->queue);
+        p->queue = NULL;
+    }
+    free(p->mv);
+    p->mv = NULL;
+    uninit(&p->ctx);
+}
@@ -0,0 +1,150 @@
+/** @file pyramid.c
+*   @brief Hierarchical (pyramid) block matching on top of EPZS
+*   @author Thomas Pegot
+*/
+
+#include "motion.h"
+#include <string.h>
+#include "esp_heap_caps.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char *TAG = "pyramid";
+#endif
+
+/** @brief default number of levels */
+#define PYR_LEVELS 3
+
+/** @brief  allocate DRAM that is byte-addressable */
+static void *_malloc(size_t size) {
+    void *res = malloc(size);
+    if(res)
+        return res;
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+/** @brief decimate by 2 with a 2x2 average, dst is (w/2) * (h/2) */
+static void downscale2(const uint8_t *src, int w, int h, uint8_t *dst) {
+    const int dw = w >> 1, dh = h >> 1;
+    int i, j;
+
+    for (j = 0; j < dh; j++) {
+        const uint8_t *l0 = src + 2 * j * w, *l1 = l0 + w;
+        for (i = 0; i < dw; i++)
+            dst[i] = (l0[2 * i] + l0[2 * i + 1] + l1[2 * i] + l1[2 * i + 1] + 2) >> 2;
+        dst += dw;
+    }
+}
+
+bool me_pyramid_alloc(MotionEstContext *ctx) {
+    size_t size = 0;
+    uint8_t *buf;
+    int l, n;
+
+    if (ctx->pyr_levels <= 0)
+        ctx->pyr_levels = PYR_LEVELS;
+    // keep only the levels where a block matching can run
+    for (n = 1; n < ctx->pyr_levels && (ctx->width >> n) > 4 * ctx->mbSize
+                && (ctx->height >> n) >= ctx->mbSize; n++)
+        size += 2 * (size_t)(ctx->width >> n) * (ctx->height >> n);
+    ctx->pyr_levels = n;
+    if (n == 1)
+        return true;
+
+    ctx->pyr = (MotionEstContext*)calloc(n - 1, sizeof(*ctx->pyr));
+    ctx->pyr_buf = buf = (uint8_t*)_malloc(size);
+    if (!ctx->pyr || !buf)
+        goto fail;
+
+    for (l = 0; l < n - 1; l++) {
+        MotionEstContext *c = &ctx->pyr[l];
+        c->method = BLOCK_MATCHING_EPZS;
+        c->width  = ctx->width  >> (l + 1);
+        c->height = ctx->height >> (l + 1);
+        c->mbSize = ctx->mbSize;
+        c->threads = ctx->threads;
+        c->sea = ctx->sea;
+        c->pool = ctx->pool;
+        // coarsest level uses search_param, each finer level doubles it
+        c->search_param = ctx->search_param << (n - 2 - l);
+        c->coarse = l + 1 < n - 1 ? &ctx->pyr[l + 1] : NULL;
+        c->data_ref = buf;
+        c->data_cur = buf + c->width * c->height;
+        buf += 2 * c->width * c->height;
+        if (!init_block_matching(c, 3) || (c->sea && !me_sea_alloc(c)))
+            goto fail;
+    }
+    ctx->coarse = &ctx->pyr[0];
+    ctx->pyr_frame = NULL;
+    return true;
+
+fail:
+    ESP_LOGE(TAG, "allocation failed!");
+    me_pyramid_free(ctx);
+    return false;
+}
+
+void me_pyramid_free(MotionEstContext *ctx) {
+    int l, i;
+
+    if (ctx->pyr) {
+        for (l = 0; l < ctx->pyr_levels - 1; l++) {
+            for (i = 0; i < 3; i++)
+                free(ctx->pyr[l].mv_table[i]);
+            for (i = 0; i < 2; i++)
+                free(ctx->pyr[l].sum_table[i]);
+        }
+        free(ctx->pyr);
+    }
+    free(ctx->pyr_buf);
+    ctx->pyr = NULL;
+    ctx->pyr_buf = NULL;
+    ctx->pyr_frame = NULL;
+    ctx->coarse = NULL;
+}
+
+bool motionEstPyramid(MotionEstContext *ctx) {
+    const int n = ctx->pyr_levels;
+    const int p = ctx->search_param;
+    const bool reuse = ctx->pyr_frame && ctx->pyr_frame == ctx->data_ref;
+    bool ret = true;
+    int l;
+
+    // decimate the frames, when the reference was the previous current frame its levels are reused
+    for (l = 0; l < n - 1; l++) {
+        MotionEstContext *c = &ctx->pyr[l];
+        const uint8_t *src_cur = l ? ctx->pyr[l - 1].data_cur : ctx->data_cur;
+        const uint8_t *src_ref = l ? ctx->pyr[l - 1].data_ref : ctx->data_ref;
+        const int w = l ? ctx->pyr[l - 1].width  : ctx->width;
+        const int h = l ? ctx->pyr[l - 1].height : ctx->height;
+
+        if (reuse) {
+            uint8_t *tmp = c->data_ref;
+            c->data_ref = c->data_cur;
+            c->data_cur = tmp;
+        } else
+            downscale2(src_ref, w, h, c->data_ref);
+        downscale2(src_cur, w, h, c->data_cur);
+    }
+    ctx->pyr_frame = ctx->data_cur;
+
+    // coarse to fine
+    for (l = n - 2; l >= 0 && ret; l--) {
+        MotionEstContext *c = &ctx->pyr[l];
+        c->cost_count = c->cost_aborted = c->sea_rejected = 0;
+        me_sea_update(c);
+        ret = motionEstEPZS(c);
+        ctx->cost_count += c->cost_count;
+        ctx->cost_aborted += c->cost_aborted;
+        ctx->sea_rejected += c->sea_rejected;
+    }
+
+    // full resolution : window scaled as the vectors of the finer decimated level
+    ctx->search_param = p << (n - 1);
+    ret = ret && motionEstEPZS(ctx);
+    ctx->search_param = p;
+    return ret;
+}
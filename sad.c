@@ -0,0 +1,585 @@
+/** @file sad.c
+*   @brief SAD kernels (C, SSE2, AVX2) and runtime selection
+*
+*   All kernels return exactly the same value, they only differ in speed.
+*   @author Thomas Pegot
+*/
+
+#include "sad.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+/** @brief if 0 only the portable C kernel is used */
+#define SAD_SIMD 1
+
+#if SAD_SIMD && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) && !defined(__INTEL_COMPILER)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+uint32_t me_sad_c(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    uint32_t sad = 0;
+    int i, j;
+
+    for (j = 0; j < mbSize; j++) {
+        for (i = 0; i < mbSize; i++)
+            sad += abs(cur[i] - ref[i]);
+        cur += linesize;
+        ref += linesize;
+    }
+    return sad;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define UNROLL _Pragma("GCC unroll 32")
+#else
+#define UNROLL
+#endif
+
+/** @brief generate me_sad_c_<n> : C kernel with constant trip counts */
+#define SAD_C_FUNC(n)                                                                       \
+uint32_t me_sad_c_##n(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {  \
+    uint32_t sad = 0;                                                                       \
+    int i, j;                                                                               \
+    (void)mbSize;                                                                           \
+    UNROLL                                                                                  \
+    for (j = 0; j < n; j++) {                                                               \
+        UNROLL                                                                              \
+        for (i = 0; i < n; i++)                                                             \
+            sad += abs(cur[i] - ref[i]);                                                    \
+        cur += linesize;                                                                    \
+        ref += linesize;                                                                    \
+    }                                                                                       \
+    return sad;                                                                             \
+}
+
+SAD_C_FUNC(4)
+SAD_C_FUNC(8)
+SAD_C_FUNC(16)
+SAD_C_FUNC(32)
+
+uint32_t me_sad_bounded_c(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize, uint32_t limit) {
+    uint32_t sad = 0;
+    int i, j;
+
+    for (j = 0; j < mbSize; j++) {
+        for (i = 0; i < mbSize; i++)
+            sad += abs(cur[i] - ref[i]);
+        if (sad >= limit && j + 1 < mbSize)
+            return sad | ME_SAD_ABORTED;
+        cur += linesize;
+        ref += linesize;
+    }
+    return sad;
+}
+
+/** @brief generate me_sad_bounded_c_<n> : me_sad_bounded_c with constant trip counts */
+#define SAD_BOUNDED_C_FUNC(n)                                                               \
+static uint32_t me_sad_bounded_c_##n(const uint8_t *cur, const uint8_t *ref, int linesize, \
+                                     int mbSize, uint32_t limit) {                          \
+    uint32_t sad = 0;                                                                       \
+    int i, j;                                                                               \
+    (void)mbSize;                                                                           \
+    for (j = 0; j < n; j++) {                                                               \
+        UNROLL                                                                              \
+        for (i = 0; i < n; i++)                                                             \
+            sad += abs(cur[i] - ref[i]);                                                    \
+        if (sad >= limit && j + 1 < n)                                                      \
+            return sad | ME_SAD_ABORTED;                                                    \
+        cur += linesize;                                                                    \
+        ref += linesize;                                                                    \
+    }                                                                                       \
+    return sad;                                                                             \
+}
+
+SAD_BOUNDED_C_FUNC(4)
+SAD_BOUNDED_C_FUNC(8)
+SAD_BOUNDED_C_FUNC(16)
+SAD_BOUNDED_C_FUNC(32)
+
+/** @brief min of the 4 partial sums of a x4 kernel */
+static inline uint32_t min4(uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3) {
+    const uint32_t a = s0 < s1 ? s0 : s1;
+    const uint32_t b = s2 < s3 ? s2 : s3;
+    return a < b ? a : b;
+}
+
+/** @brief store the 4 sums of a x4 kernel, flagged if the block was not fully scanned */
+static inline void store_x4_c(uint32_t sad[4], uint32_t s0, uint32_t s1, uint32_t s2, uint32_t s3,
+                              uint32_t flag) {
+    sad[0] = s0 | flag; sad[1] = s1 | flag; sad[2] = s2 | flag; sad[3] = s3 | flag;
+}
+
+void me_sad_x4_c(const uint8_t *cur, const uint8_t *const ref[4], int linesize, int mbSize,
+                 uint32_t limit, uint32_t sad[4]) {
+    const uint8_t *r0 = ref[0], *r1 = ref[1], *r2 = ref[2], *r3 = ref[3];
+    uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i, j;
+
+    for (j = 0; j < mbSize; j++) {
+        for (i = 0; i < mbSize; i++) {
+            const int c = cur[i];
+            s0 += abs(c - r0[i]);
+            s1 += abs(c - r1[i]);
+            s2 += abs(c - r2[i]);
+            s3 += abs(c - r3[i]);
+        }
+        if (j + 1 < mbSize && min4(s0, s1, s2, s3) >= limit)
+            return store_x4_c(sad, s0, s1, s2, s3, ME_SAD_ABORTED);
+        cur += linesize;
+        r0 += linesize; r1 += linesize; r2 += linesize; r3 += linesize;
+    }
+    store_x4_c(sad, s0, s1, s2, s3, 0);
+}
+
+/** @brief generate me_sad_x4_c_<n> : 4 candidates C kernel with constant trip counts */
+#define SAD_X4_C_FUNC(n)                                                                    \
+static void me_sad_x4_c_##n(const uint8_t *cur, const uint8_t *const ref[4], int linesize, \
+                            int mbSize, uint32_t limit, uint32_t sad[4]) {                  \
+    const uint8_t *r0 = ref[0], *r1 = ref[1], *r2 = ref[2], *r3 = ref[3];                   \
+    uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;                                                \
+    int i, j;                                                                               \
+    (void)mbSize;                                                                           \
+    for (j = 0; j < n; j++) {                                                               \
+        UNROLL                                                                              \
+        for (i = 0; i < n; i++) {                                                           \
+            const int c = cur[i];                                                           \
+            s0 += abs(c - r0[i]);                                                           \
+            s1 += abs(c - r1[i]);                                                           \
+            s2 += abs(c - r2[i]);                                                           \
+            s3 += abs(c - r3[i]);                                                           \
+        }                                                                                   \
+        if (j + 1 < n && min4(s0, s1, s2, s3) >= limit)                                     \
+            return store_x4_c(sad, s0, s1, s2, s3, ME_SAD_ABORTED);                         \
+        cur += linesize;                                                                    \
+        r0 += linesize; r1 += linesize; r2 += linesize; r3 += linesize;                     \
+    }                                                                                       \
+    store_x4_c(sad, s0, s1, s2, s3, 0);                                                     \
+}
+
+SAD_X4_C_FUNC(4)
+SAD_X4_C_FUNC(8)
+SAD_X4_C_FUNC(16)
+SAD_X4_C_FUNC(32)
+
+#if HAVE_SSE2
+/** @brief load 4 bytes from unaligned address */
+static inline __m128i load4(const uint8_t *p) {
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return _mm_cvtsi32_si128(v);
+}
+
+/** @brief load 2 lines of 8 bytes in one register */
+static inline __m128i load8x2(const uint8_t *p, int linesize) {
+    return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p),
+                              _mm_loadl_epi64((const __m128i *)(p + linesize)));
+}
+
+/** @brief SAD of 16 bytes */
+static inline __m128i sad16(const uint8_t *cur, const uint8_t *ref) {
+    return _mm_sad_epu8(_mm_loadu_si128((const __m128i *)cur), _mm_loadu_si128((const __m128i *)ref));
+}
+
+/** @brief add the two 64 bits lanes of psadbw result */
+static inline uint32_t hsum_sad(__m128i acc) {
+    return (uint32_t)_mm_cvtsi128_si32(_mm_add_epi32(acc, _mm_srli_si128(acc, 8)));
+}
+
+/** @brief 4x4 : the 4 lines in one register */
+static uint32_t me_sad_sse2_4(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    const __m128i c = _mm_unpacklo_epi64(_mm_unpacklo_epi32(load4(cur), load4(cur + linesize)),
+                      _mm_unpacklo_epi32(load4(cur + 2 * linesize), load4(cur + 3 * linesize)));
+    const __m128i r = _mm_unpacklo_epi64(_mm_unpacklo_epi32(load4(ref), load4(ref + linesize)),
+                      _mm_unpacklo_epi32(load4(ref + 2 * linesize), load4(ref + 3 * linesize)));
+    (void)mbSize;
+    return hsum_sad(_mm_sad_epu8(c, r));
+}
+
+/** @brief 8x8 : two lines per register */
+static uint32_t me_sad_sse2_8(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    const int l2 = 2 * linesize, l4 = 4 * linesize, l6 = 6 * linesize;
+    __m128i acc = _mm_sad_epu8(load8x2(cur, linesize), load8x2(ref, linesize));
+    (void)mbSize;
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(load8x2(cur + l2, linesize), load8x2(ref + l2, linesize)));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(load8x2(cur + l4, linesize), load8x2(ref + l4, linesize)));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(load8x2(cur + l6, linesize), load8x2(ref + l6, linesize)));
+    return hsum_sad(acc);
+}
+
+/** @brief 16x16 : one line per register */
+static uint32_t me_sad_sse2_16(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    __m128i acc = _mm_setzero_si128();
+    int j;
+    (void)mbSize;
+    UNROLL
+    for (j = 0; j < 16; j++) {
+        acc = _mm_add_epi64(acc, sad16(cur, ref));
+        cur += linesize;
+        ref += linesize;
+    }
+    return hsum_sad(acc);
+}
+
+/** @brief 32x32 : two registers per line */
+static uint32_t me_sad_sse2_32(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    __m128i acc = _mm_setzero_si128();
+    int j;
+    (void)mbSize;
+    for (j = 0; j < 32; j++) {
+        acc = _mm_add_epi64(acc, sad16(cur, ref));
+        acc = _mm_add_epi64(acc, sad16(cur + 16, ref + 16));
+        cur += linesize;
+        ref += linesize;
+    }
+    return hsum_sad(acc);
+}
+
+/** @brief any mbSize multiple of 16 */
+static uint32_t me_sad_sse2(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    __m128i acc = _mm_setzero_si128();
+    int i, j;
+
+    for (j = 0; j < mbSize; j++) {
+        for (i = 0; i < mbSize; i += 16)
+            acc = _mm_add_epi64(acc, sad16(cur + i, ref + i));
+        cur += linesize;
+        ref += linesize;
+    }
+    return hsum_sad(acc);
+}
+
+/** @brief load a 4x4 block in one register */
+static inline __m128i load4x4(const uint8_t *p, int linesize) {
+    return _mm_unpacklo_epi64(_mm_unpacklo_epi32(load4(p), load4(p + linesize)),
+                              _mm_unpacklo_epi32(load4(p + 2 * linesize), load4(p + 3 * linesize)));
+}
+
+/** @brief store the 4 accumulators of a x4 kernel */
+static inline void store_x4(uint32_t sad[4], __m128i a0, __m128i a1, __m128i a2, __m128i a3, uint32_t flag) {
+    store_x4_c(sad, hsum_sad(a0), hsum_sad(a1), hsum_sad(a2), hsum_sad(a3), flag);
+}
+
+/** @brief true if the 4 partial sums reached limit */
+static inline int over_x4(__m128i a0, __m128i a1, __m128i a2, __m128i a3, uint32_t limit) {
+    return min4(hsum_sad(a0), hsum_sad(a1), hsum_sad(a2), hsum_sad(a3)) >= limit;
+}
+
+/** @brief 8x8, checked against limit after 4 lines */
+static uint32_t me_sad_bounded_sse2_8(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize,
+                                      uint32_t limit) {
+    const int l2 = 2 * linesize, l4 = 4 * linesize, l6 = 6 * linesize;
+    __m128i acc = _mm_sad_epu8(load8x2(cur, linesize), load8x2(ref, linesize));
+    uint32_t sad;
+    (void)mbSize;
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(load8x2(cur + l2, linesize), load8x2(ref + l2, linesize)));
+    if ((sad = hsum_sad(acc)) >= limit)
+        return sad | ME_SAD_ABORTED;
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(load8x2(cur + l4, linesize), load8x2(ref + l4, linesize)));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(load8x2(cur + l6, linesize), load8x2(ref + l6, linesize)));
+    return hsum_sad(acc);
+}
+
+/** @brief any mbSize multiple of 16, checked against limit every 4 lines */
+static uint32_t me_sad_bounded_sse2(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize,
+                                    uint32_t limit) {
+    __m128i acc = _mm_setzero_si128();
+    uint32_t sad;
+    int i, j;
+
+    for (j = 0; j < mbSize; j++) {
+        for (i = 0; i < mbSize; i += 16)
+            acc = _mm_add_epi64(acc, sad16(cur + i, ref + i));
+        if ((j & 3) == 3 && j + 1 < mbSize && (sad = hsum_sad(acc)) >= limit)
+            return sad | ME_SAD_ABORTED;
+        cur += linesize;
+        ref += linesize;
+    }
+    return hsum_sad(acc);
+}
+
+static void me_sad_x4_sse2_4(const uint8_t *cur, const uint8_t *const ref[4], int linesize,
+                             int mbSize, uint32_t limit, uint32_t sad[4]) {
+    const __m128i c = load4x4(cur, linesize);
+    (void)mbSize; (void)limit;
+    store_x4(sad, _mm_sad_epu8(c, load4x4(ref[0], linesize)), _mm_sad_epu8(c, load4x4(ref[1], linesize)),
+                  _mm_sad_epu8(c, load4x4(ref[2], linesize)), _mm_sad_epu8(c, load4x4(ref[3], linesize)), 0);
+}
+
+static void me_sad_x4_sse2_8(const uint8_t *cur, const uint8_t *const ref[4], int linesize,
+                             int mbSize, uint32_t limit, uint32_t sad[4]) {
+    __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+    int j;
+    (void)mbSize;
+    for (j = 0; j < 8 * linesize; j += 2 * linesize) {
+        const __m128i c = load8x2(cur + j, linesize);
+        a0 = _mm_add_epi64(a0, _mm_sad_epu8(c, load8x2(ref[0] + j, linesize)));
+        a1 = _mm_add_epi64(a1, _mm_sad_epu8(c, load8x2(ref[1] + j, linesize)));
+        a2 = _mm_add_epi64(a2, _mm_sad_epu8(c, load8x2(ref[2] + j, linesize)));
+        a3 = _mm_add_epi64(a3, _mm_sad_epu8(c, load8x2(ref[3] + j, linesize)));
+        if (j == 2 * linesize && over_x4(a0, a1, a2, a3, limit))
+            return store_x4(sad, a0, a1, a2, a3, ME_SAD_ABORTED);
+    }
+    store_x4(sad, a0, a1, a2, a3, 0);
+}
+
+/** @brief any mbSize multiple of 16, each 16 bytes of the current line is loaded once */
+static void me_sad_x4_sse2(const uint8_t *cur, const uint8_t *const ref[4], int linesize,
+                           int mbSize, uint32_t limit, uint32_t sad[4]) {
+    __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;
+    int i, j, l;
+
+    for (l = 0, j = 0; l < mbSize; l++, j += linesize) {
+        for (i = j; i < j + mbSize; i += 16) {
+            const __m128i c = _mm_loadu_si128((const __m128i *)(cur + i));
+            a0 = _mm_add_epi64(a0, _mm_sad_epu8(c, _mm_loadu_si128((const __m128i *)(ref[0] + i))));
+            a1 = _mm_add_epi64(a1, _mm_sad_epu8(c, _mm_loadu_si128((const __m128i *)(ref[1] + i))));
+            a2 = _mm_add_epi64(a2, _mm_sad_epu8(c, _mm_loadu_si128((const __m128i *)(ref[2] + i))));
+            a3 = _mm_add_epi64(a3, _mm_sad_epu8(c, _mm_loadu_si128((const __m128i *)(ref[3] + i))));
+        }
+        if ((l & 3) == 3 && l + 1 < mbSize && over_x4(a0, a1, a2, a3, limit))
+            return store_x4(sad, a0, a1, a2, a3, ME_SAD_ABORTED);
+    }
+    store_x4(sad, a0, a1, a2, a3, 0);
+}
+#endif
+
+#if HAVE_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+/** @brief load 2 lines of 16 bytes in one register */
+AVX2 static inline __m256i load16x2(const uint8_t *p, int linesize) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                   _mm_loadu_si128((const __m128i *)(p + linesize)), 1);
+}
+
+/** @brief add the four 64 bits lanes of vpsadbw result */
+AVX2 static inline uint32_t hsum_sad256(__m256i acc) {
+    const __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return (uint32_t)_mm_cvtsi128_si32(_mm_add_epi32(sum, _mm_srli_si128(sum, 8)));
+}
+
+/** @brief 16x16 : two lines per register */
+AVX2 static uint32_t me_sad_avx2_16(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    __m256i acc = _mm256_setzero_si256();
+    int j;
+    (void)mbSize;
+    UNROLL
+    for (j = 0; j < 16; j += 2) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(load16x2(cur, linesize), load16x2(ref, linesize)));
+        cur += 2 * linesize;
+        ref += 2 * linesize;
+    }
+    return hsum_sad256(acc);
+}
+
+/** @brief any mbSize multiple of 32, one register per 32 bytes */
+AVX2 static uint32_t me_sad_avx2(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    __m256i acc = _mm256_setzero_si256();
+    int i, j;
+
+    for (j = 0; j < mbSize; j++) {
+        for (i = 0; i < mbSize; i += 32)
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(cur + i)),
+                                                        _mm256_loadu_si256((const __m256i *)(ref + i))));
+        cur += linesize;
+        ref += linesize;
+    }
+    return hsum_sad256(acc);
+}
+
+/** @brief 32x32 : one line per register */
+AVX2 static uint32_t me_sad_avx2_32(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize) {
+    __m256i acc = _mm256_setzero_si256();
+    int j;
+    (void)mbSize;
+    for (j = 0; j < 32; j++) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)cur),
+                                                    _mm256_loadu_si256((const __m256i *)ref)));
+        cur += linesize;
+        ref += linesize;
+    }
+    return hsum_sad256(acc);
+}
+
+/** @brief 16x16, checked against limit every 4 lines */
+AVX2 static uint32_t me_sad_bounded_avx2_16(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize,
+                                            uint32_t limit) {
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t sad;
+    int j;
+    (void)mbSize;
+    for (j = 0; j < 16; j += 2) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(load16x2(cur, linesize), load16x2(ref, linesize)));
+        if ((j & 3) == 2 && j < 14 && (sad = hsum_sad256(acc)) >= limit)
+            return sad | ME_SAD_ABORTED;
+        cur += 2 * linesize;
+        ref += 2 * linesize;
+    }
+    return hsum_sad256(acc);
+}
+
+/** @brief any mbSize multiple of 32, checked against limit every 4 lines */
+AVX2 static uint32_t me_sad_bounded_avx2(const uint8_t *cur, const uint8_t *ref, int linesize, int mbSize,
+                                         uint32_t limit) {
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t sad;
+    int i, j;
+
+    for (j = 0; j < mbSize; j++) {
+        for (i = 0; i < mbSize; i += 32)
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(cur + i)),
+                                                        _mm256_loadu_si256((const __m256i *)(ref + i))));
+        if ((j & 3) == 3 && j + 1 < mbSize && (sad = hsum_sad256(acc)) >= limit)
+            return sad | ME_SAD_ABORTED;
+        cur += linesize;
+        ref += linesize;
+    }
+    return hsum_sad256(acc);
+}
+
+/** @brief store the 4 accumulators of a x4 kernel */
+AVX2 static inline void store_x4_256(uint32_t sad[4], __m256i a0, __m256i a1, __m256i a2, __m256i a3,
+                                     uint32_t flag) {
+    store_x4_c(sad, hsum_sad256(a0), hsum_sad256(a1), hsum_sad256(a2), hsum_sad256(a3), flag);
+}
+
+/** @brief true if the 4 partial sums reached limit */
+AVX2 static inline int over_x4_256(__m256i a0, __m256i a1, __m256i a2, __m256i a3, uint32_t limit) {
+    return min4(hsum_sad256(a0), hsum_sad256(a1), hsum_sad256(a2), hsum_sad256(a3)) >= limit;
+}
+
+/** @brief 16x16, two lines of the current block per register */
+AVX2 static void me_sad_x4_avx2_16(const uint8_t *cur, const uint8_t *const ref[4], int linesize,
+                                   int mbSize, uint32_t limit, uint32_t sad[4]) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+    int j, l;
+    (void)mbSize;
+    for (l = 0, j = 0; l < 16; l += 2, j += 2 * linesize) {
+        const __m256i c = load16x2(cur + j, linesize);
+        a0 = _mm256_add_epi64(a0, _mm256_sad_epu8(c, load16x2(ref[0] + j, linesize)));
+        a1 = _mm256_add_epi64(a1, _mm256_sad_epu8(c, load16x2(ref[1] + j, linesize)));
+        a2 = _mm256_add_epi64(a2, _mm256_sad_epu8(c, load16x2(ref[2] + j, linesize)));
+        a3 = _mm256_add_epi64(a3, _mm256_sad_epu8(c, load16x2(ref[3] + j, linesize)));
+        if ((l & 3) == 2 && l < 14 && over_x4_256(a0, a1, a2, a3, limit))
+            return store_x4_256(sad, a0, a1, a2, a3, ME_SAD_ABORTED);
+    }
+    store_x4_256(sad, a0, a1, a2, a3, 0);
+}
+
+/** @brief any mbSize multiple of 32 */
+AVX2 static void me_sad_x4_avx2(const uint8_t *cur, const uint8_t *const ref[4], int linesize,
+                                int mbSize, uint32_t limit, uint32_t sad[4]) {
+    __m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;
+    int i, j, l;
+
+    for (l = 0, j = 0; l < mbSize; l++, j += linesize) {
+        for (i = j; i < j + mbSize; i += 32) {
+            const __m256i c = _mm256_loadu_si256((const __m256i *)(cur + i));
+            a0 = _mm256_add_epi64(a0, _mm256_sad_epu8(c, _mm256_loadu_si256((const __m256i *)(ref[0] + i))));
+            a1 = _mm256_add_epi64(a1, _mm256_sad_epu8(c, _mm256_loadu_si256((const __m256i *)(ref[1] + i))));
+            a2 = _mm256_add_epi64(a2, _mm256_sad_epu8(c, _mm256_loadu_si256((const __m256i *)(ref[2] + i))));
+            a3 = _mm256_add_epi64(a3, _mm256_sad_epu8(c, _mm256_loadu_si256((const __m256i *)(ref[3] + i))));
+        }
+        if ((l & 3) == 3 && l + 1 < mbSize && over_x4_256(a0, a1, a2, a3, limit))
+            return store_x4_256(sad, a0, a1, a2, a3, ME_SAD_ABORTED);
+    }
+    store_x4_256(sad, a0, a1, a2, a3, 0);
+}
+#endif
+
+__attribute__((weak)) me_sad_func me_sad_select_pie(int mbSize) {
+    (void)mbSize;
+    return NULL;
+}
+
+me_sad_func me_sad_select(int mbSize) {
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        if (mbSize == 16)
+            return &me_sad_avx2_16;
+        if (mbSize == 32)
+            return &me_sad_avx2_32;
+        if ((mbSize & 31) == 0)
+            return &me_sad_avx2;
+    }
+#endif
+#if HAVE_SSE2
+    switch (mbSize) {
+        case 4  : return &me_sad_sse2_4;
+        case 8  : return &me_sad_sse2_8;
+        case 16 : return &me_sad_sse2_16;
+        case 32 : return &me_sad_sse2_32;
+        default : if ((mbSize & 15) == 0) return &me_sad_sse2;
+    }
+#endif
+#if SAD_SIMD && defined(CONFIG_IDF_TARGET_ESP32S3)
+    me_sad_func pie = me_sad_select_pie(mbSize);
+    if (pie)
+        return pie;
+#endif
+    switch (mbSize) {
+        case 4  : return &me_sad_c_4;
+        case 8  : return &me_sad_c_8;
+        case 16 : return &me_sad_c_16;
+        case 32 : return &me_sad_c_32;
+        default : return &me_sad_c;
+    }
+}
+
+me_sad_x4_func me_sad_x4_select(int mbSize) {
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        if (mbSize == 16)
+            return &me_sad_x4_avx2_16;
+        if ((mbSize & 31) == 0)
+            return &me_sad_x4_avx2;
+    }
+#endif
+#if HAVE_SSE2
+    switch (mbSize) {
+        case 4  : return &me_sad_x4_sse2_4;
+        case 8  : return &me_sad_x4_sse2_8;
+        default : if ((mbSize & 15) == 0) return &me_sad_x4_sse2;
+    }
+#endif
+    switch (mbSize) {
+        case 4  : return &me_sad_x4_c_4;
+        case 8  : return &me_sad_x4_c_8;
+        case 16 : return &me_sad_x4_c_16;
+        case 32 : return &me_sad_x4_c_32;
+        default : return &me_sad_x4_c;
+    }
+}
+
+me_sad_bounded_func me_sad_bounded_select(int mbSize) {
+#if HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        if (mbSize == 16)
+            return &me_sad_bounded_avx2_16;
+        if ((mbSize & 31) == 0)
+            return &me_sad_bounded_avx2;
+    }
+#endif
+#if HAVE_SSE2
+    if (mbSize == 8)
+        return &me_sad_bounded_sse2_8;
+    if ((mbSize & 15) == 0)
+        return &me_sad_bounded_sse2;
+#endif
+    switch (mbSize) {
+        case 4  : return &me_sad_bounded_c_4;
+        case 8  : return &me_sad_bounded_c_8;
+        case 16 : return &me_sad_bounded_c_16;
+        case 32 : return &me_sad_bounded_c_32;
+        default : return &me_sad_bounded_c;
+    }
+}
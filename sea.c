@@ -0,0 +1,68 @@
+/** @file sea.c
+*   @brief Successive Elimination Algorithm (SEA) block sum tables
+*
+*   A candidate can only be better than the current best if
+*   \f$ |\sum Cur - \sum Ref| \le SAD < cost_{min} \f$, block sums are read
+*   from an integral image in 4 lookups.
+*   @author Thomas Pegot
+*/
+
+#include "motion.h"
+#include <string.h>
+#include "esp_heap_caps.h"
+
+/** @brief  allocate DRAM that is byte-addressable */
+static void *_malloc(size_t size) {
+    void *res = malloc(size);
+    if(res)
+        return res;
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+void integral_image(const uint8_t *img, uint32_t *table, int w, int h) {
+    const int stride = w + 1;
+    int i, j;
+
+    memset(table, 0, stride * sizeof(*table));
+    for (j = 0; j < h; j++) {
+        uint32_t *line = table + (j + 1) * stride;
+        const uint32_t *up = line - stride;
+        uint32_t sum = 0;
+
+        line[0] = 0;
+        for (i = 0; i < w; i++) {
+            sum += img[i];
+            line[i + 1] = up[i + 1] + sum;
+        }
+        img += w;
+    }
+}
+
+bool me_sea_alloc(MotionEstContext *ctx) {
+    const size_t size = (ctx->width + 1) * (ctx->height + 1) * sizeof(uint32_t);
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        ctx->sum_table[i] = (uint32_t*)_malloc(size);
+        if (!ctx->sum_table[i])
+            return false;
+    }
+    ctx->sum_frame = NULL;
+    return true;
+}
+
+void me_sea_update(MotionEstContext *ctx) {
+    if (!ctx->sum_table[0])
+        return;
+
+    if (ctx->sum_frame && ctx->sum_frame == ctx->data_ref) {
+        // previous current frame is the new reference : its table is already computed
+        uint32_t *tmp = ctx->sum_table[1];
+        ctx->sum_table[1] = ctx->sum_table[0];
+        ctx->sum_table[0] = tmp;
+    } else
+        integral_image(ctx->data_ref, ctx->sum_table[1], ctx->width, ctx->height);
+
+    integral_image(ctx->data_cur, ctx->sum_table[0], ctx->width, ctx->height);
+    ctx->sum_frame = ctx->data_cur;
+}
@@ -0,0 +1,146 @@
+/** @file subpel.c
+*   @brief Half and quarter pixel refinement of block matching vectors
+*
+*   The half pixel planes of the reference are interpolated once per frame,
+*   quarter pixel samples are the average of the nearest half pixel ones (computed on demand).
+*   @author Thomas Pegot
+*/
+
+#include "motion.h"
+#include <string.h>
+#include "esp_heap_caps.h"
+
+/** @brief  allocate DRAM that is byte-addressable */
+static void *_malloc(size_t size) {
+    void *res = malloc(size);
+    if(res)
+        return res;
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+}
+
+static inline uint8_t clip_uint8(int a) {
+    return a < 0 ? 0 : a > 255 ? 255 : a;
+}
+
+/** @brief 6-tap (1, -5, 20, 20, -5, 1) / 32 between p[i * step] and p[(i + 1) * step], index clamped to [0, max] */
+static inline uint8_t tap6(const uint8_t *p, int step, int i, int max) {
+#define AT(k) p[mmax(0, mmin(i + (k), max)) * step]
+    return clip_uint8((AT(-2) + AT(3) - 5 * (AT(-1) + AT(2)) + 20 * (AT(0) + AT(1)) + 16) >> 5);
+#undef AT
+}
+
+/** @brief interpolate the half pixel planes h (x + 1/2), v (y + 1/2) and hv of src */
+static void half_planes(const uint8_t *src, int w, int h, int filter, uint8_t *ph, uint8_t *pv, uint8_t *phv) {
+    int x, y;
+
+    for (y = 0; y < h; y++) {
+        const uint8_t *s = src + y * w;
+        for (x = 0; x < w; x++) {
+            const int x1 = mmin(x + 1, w - 1);
+            ph[y * w + x] = filter == SUBPEL_6TAP ? tap6(s, 1, x, w - 1) : (s[x] + s[x1] + 1) >> 1;
+        }
+    }
+    for (y = 0; y < h; y++) {
+        const int y1 = mmin(y + 1, h - 1);
+        for (x = 0; x < w; x++) {
+            if (filter == SUBPEL_6TAP) {
+                pv[y * w + x]  = tap6(src + x, w, y, h - 1);
+                phv[y * w + x] = tap6(ph + x, w, y, h - 1);
+            } else {
+                pv[y * w + x]  = (src[y * w + x] + src[y1 * w + x] + 1) >> 1;
+                phv[y * w + x] = (src[y * w + x] + src[y * w + mmin(x + 1, w - 1)]
+                                 + src[y1 * w + x] + src[y1 * w + mmin(x + 1, w - 1)] + 2) >> 2;
+            }
+        }
+    }
+}
+
+/** @brief plane and offset of the half pixel sample (hx, hy), in 1/2 pixel */
+static inline const uint8_t *half_sample(const MotionEstContext *ctx, int hx, int hy) {
+    const uint8_t *plane = (hx & 1) ? ((hy & 1) ? ctx->subpel_planes[2] : ctx->subpel_planes[0])
+                                    : ((hy & 1) ? ctx->subpel_planes[1] : ctx->data_ref);
+    return plane + (hy >> 1) * ctx->width + (hx >> 1);
+}
+
+/** @brief SAD of block (x_mb, y_mb) against the reference at (qx, qy), in 1/4 pixel */
+static uint32_t subpel_cost(MotionEstContext *ctx, int x_mb, int y_mb, int qx, int qy) {
+    const int linesize = ctx->width;
+    const int n = ctx->mbSize;
+    const uint8_t *cur = ctx->data_cur + y_mb * linesize + x_mb;
+    const int hx = qx >> 1, hy = qy >> 1;
+    const uint8_t *a, *b;
+    uint8_t *dst = ctx->subpel_block;
+    int i, j;
+
+    ctx->cost_count++;
+    a = half_sample(ctx, hx, hy);
+    if (!((qx | qy) & 1)) // half pixel position : read from the cached planes
+        return ctx->sad(cur, a, linesize, n);
+
+    // quarter pixel : average of the 2 nearest half pixel samples (the diagonal ones if both odd)
+    if ((qx & qy) & 1) {
+        a = half_sample(ctx, hx + 1, hy);
+        b = half_sample(ctx, hx, hy + 1);
+    } else
+        b = half_sample(ctx, hx + (qx & 1), hy + (qy & 1));
+    for (j = 0; j < n; j++)
+        for (i = 0; i < n; i++)
+            dst[j * linesize + i] = (a[j * linesize + i] + b[j * linesize + i] + 1) >> 1;
+    return ctx->sad(cur, dst, linesize, n);
+}
+
+bool me_subpel_alloc(MotionEstContext *ctx) {
+    const size_t size = (size_t)ctx->width * ctx->height;
+
+    ctx->subpel_planes[0] = (uint8_t*)_malloc(3 * size + ctx->mbSize * ctx->width);
+    ctx->mvq_table = (MotionVectorQ16_t*)calloc(ctx->b_count, sizeof(*ctx->mvq_table));
+    if (!ctx->subpel_planes[0] || !ctx->mvq_table)
+        return false;
+    ctx->subpel_planes[1] = ctx->subpel_planes[0] + size;
+    ctx->subpel_planes[2] = ctx->subpel_planes[1] + size;
+    ctx->subpel_block = ctx->subpel_planes[2] + size;
+    return true;
+}
+
+bool me_subpel_refine(MotionEstContext *ctx) {
+    static const int8_t square[8][2] = {{-1,-1}, { 0,-1}, { 1,-1}, {-1, 0}, { 1, 0}, {-1, 1}, { 0, 1}, { 1, 1}};
+    const int q_x_max = ((ctx->b_width - 1) << ctx->log2_mbSize) << 2;
+    const int q_y_max = ((ctx->b_height - 1) << ctx->log2_mbSize) << 2;
+    int mb_x, mb_y, step, k;
+
+    half_planes(ctx->data_ref, ctx->width, ctx->height, ctx->subpel_filter,
+                ctx->subpel_planes[0], ctx->subpel_planes[1], ctx->subpel_planes[2]);
+
+    for (mb_y = 0; mb_y < ctx->b_height; mb_y++) {
+        for (mb_x = 0; mb_x < ctx->b_width; mb_x++) {
+            const int mb_i = mb_y * ctx->b_width + mb_x;
+            const int x_mb = mb_x << ctx->log2_mbSize, y_mb = mb_y << ctx->log2_mbSize;
+            MotionVectorQ16_t *mvq = &ctx->mvq_table[mb_i];
+            // integer vector in 1/4 pixel : position of the matching block
+            int qx = (x_mb + ctx->mv_table[0][mb_i].vx) << 2;
+            int qy = (y_mb + ctx->mv_table[0][mb_i].vy) << 2;
+            uint32_t cost_min = ctx->get_cost(ctx, x_mb, y_mb, qx >> 2, qy >> 2);
+
+            // half pixel square then quarter pixel square around the best
+            for (step = 2; step >= (ctx->subpel == SUBPEL_QUARTER ? 1 : 2); step >>= 1) {
+                const int cx = qx, cy = qy;
+                for (k = 0; k < 8; k++) {
+                    const int x = cx + step * square[k][0], y = cy + step * square[k][1];
+                    uint32_t cost;
+                    if (x < 0 || y < 0 || x > q_x_max || y > q_y_max)
+                        continue;
+                    cost = subpel_cost(ctx, x_mb, y_mb, x, y);
+                    if (cost < cost_min) {
+                        cost_min = cost;
+                        qx = x;
+                        qy = y;
+                    }
+                }
+            }
+            mvq->vx = qx - (x_mb << 2);
+            mvq->vy = qy - (y_mb << 2);
+            mvq->mag2 = (mvq->vx * mvq->vx + mvq->vy * mvq->vy + 8) >> 4;
+        }
+    }
+    return true;
+}